@@ -0,0 +1,353 @@
+/******************************************************************************
+ * ac.c - Aho-Corasick automaton for searching many patterns at once
+ *
+ * The patterns go into a trie whose failure links are folded into a
+ * complete DFA, so scanning costs one table lookup per byte however
+ * many patterns there are.  To keep the table small (and in cache) the
+ * alphabet is cut down to the bytes that occur in some pattern plus one
+ * class for all the rest, and each entry holds the next state's row
+ * offset so a step is a single add and load.  States are numbered with
+ * every state that completes a pattern last, which makes "did that
+ * byte finish a match?" one compare against a threshold.
+ *
+ * Ignoring case costs nothing: the upper and lower case of a letter
+ * simply share a class.  With AC_WORDS the word boundaries are only
+ * checked for the patterns a match completes.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ac.h"
+#include "search.h"
+
+struct ac {
+    uint8_t classes[256];       /* byte -> column of the table */
+    size_t num_classes;
+    size_t num_states;
+    uint32_t* table;            /* [row + class] = row of the next state */
+    uint32_t accept;            /* rows from here on complete a pattern */
+    uint32_t first_accepting;   /* ... i.e. accept / num_classes */
+    uint32_t* out_off;          /* accepting state k has patterns */
+    uint32_t* out_ids;          /*   out_ids[out_off[k] .. out_off[k + 1]) */
+    uint32_t* empty_ids;        /* "" patterns, which match every line */
+    size_t num_empty;
+    size_t* lens;               /* of each pattern */
+    int words;                  /* AC_WORDS */
+    size_t num_patterns;
+    size_t max_len;
+};
+
+
+/* Build the automaton for patterns[0..num), each NUL terminated, with
+ * AC_* "flags".  Returns NULL if out of memory. */
+struct ac* ac_build (char* const* patterns, size_t num, int flags)
+{
+    struct ac* ac;
+    int32_t* go = NULL;
+    uint32_t* fail = NULL;
+    uint32_t* order = NULL;
+    uint32_t* first_term = NULL;
+    uint32_t* next_term = NULL;
+    uint32_t* num_out = NULL;
+    uint32_t* new_id = NULL;
+    uint32_t* old_id = NULL;
+    size_t total = 1, len, nc, ns, head, tail, i, k, c;
+    uint32_t s, t, p, num_accepting;
+    const unsigned char* q;
+
+    ac = calloc(1, sizeof(*ac));
+    if (!ac)
+        return NULL;
+    ac->num_patterns = num;
+    ac->words = flags & AC_WORDS;
+    ac->lens = malloc((num ? num : 1) * sizeof(*ac->lens));
+    if (!ac->lens)
+        goto fail;
+
+    /* the alphabet: a class for every byte in use, 0 for the rest */
+    for (i = 0; i < num; i++) {
+        len = strlen(patterns[i]);
+        ac->lens[i] = len;
+        total += len;
+        if (len > ac->max_len)
+            ac->max_len = len;
+        for (q = (const unsigned char*)patterns[i]; *q; q++)
+            ac->classes[flags & AC_ICASE && *q - 'A' < 26u ? *q | 0x20 : *q] = 1;
+    }
+    for (nc = 1, i = 0; i < 256; i++)
+        if (ac->classes[i])
+            ac->classes[i] = nc++;
+    if (flags & AC_ICASE)
+        for (i = 'A'; i <= 'Z'; i++)
+            ac->classes[i] = ac->classes[i | 0x20];
+    ac->num_classes = nc;
+
+    if ((uint64_t)total * nc > UINT32_MAX)
+        goto fail;
+
+    go = malloc(total * nc * sizeof(*go));
+    fail = malloc(total * sizeof(*fail));
+    order = malloc(total * sizeof(*order));
+    first_term = malloc(total * sizeof(*first_term));
+    next_term = malloc((num ? num : 1) * sizeof(*next_term));
+    num_out = calloc(total, sizeof(*num_out));
+    ac->empty_ids = malloc((num ? num : 1) * sizeof(*ac->empty_ids));
+    if (!go || !fail || !order || !first_term || !next_term || !num_out || !ac->empty_ids)
+        goto fail;
+    memset(go, -1, total * nc * sizeof(*go));
+    memset(first_term, -1, total * sizeof(*first_term));
+
+    /* the trie; each pattern is listed on the state it ends in */
+    ns = 1;
+    for (i = 0; i < num; i++) {
+        if (!*patterns[i]) {
+            ac->empty_ids[ac->num_empty++] = i;
+            continue;
+        }
+        s = 0;
+        for (q = (const unsigned char*)patterns[i]; *q; q++) {
+            k = s * nc + ac->classes[*q];
+            if (go[k] < 0)
+                go[k] = ns++;
+            s = go[k];
+        }
+        next_term[i] = first_term[s];
+        first_term[s] = i;
+    }
+
+    /* breadth first, so that a state's failure target (which is
+     * shallower) already has all its transitions filled in */
+    head = tail = 0;
+    fail[0] = 0;
+    order[tail++] = 0;
+    while (head < tail) {
+        s = order[head++];
+        for (c = 0; c < nc; c++) {
+            k = s * nc + c;
+            if (go[k] < 0) {
+                go[k] = s ? go[fail[s] * nc + c] : 0;
+                continue;
+            }
+            t = go[k];
+            fail[t] = s ? (uint32_t)go[fail[s] * nc + c] : 0;
+            order[tail++] = t;
+        }
+
+        /* a state also completes whatever its failure target does */
+        for (p = first_term[s]; p != UINT32_MAX; p = next_term[p])
+            num_out[s]++;
+        if (s)
+            num_out[s] += num_out[fail[s]];
+    }
+
+    /* renumber the states, the accepting ones last */
+    new_id = malloc(ns * sizeof(*new_id));
+    old_id = malloc(ns * sizeof(*old_id));
+    if (!new_id || !old_id)
+        goto fail;
+    num_accepting = 0;
+    for (i = 0; i < ns; i++)
+        if (num_out[order[i]])
+            num_accepting++;
+    ac->first_accepting = ns - num_accepting;
+    for (i = 0, k = 0, t = ac->first_accepting; i < ns; i++) {
+        s = order[i];
+        new_id[s] = num_out[s] ? t++ : k++;
+        old_id[new_id[s]] = s;
+    }
+
+    ac->table = malloc(ns * nc * sizeof(*ac->table));
+    ac->out_off = malloc((num_accepting + 1) * sizeof(*ac->out_off));
+    if (!ac->table || !ac->out_off)
+        goto fail;
+    for (s = 0; s < ns; s++)
+        for (c = 0; c < nc; c++)
+            ac->table[new_id[s] * nc + c] = new_id[go[s * nc + c]] * nc;
+    ac->num_states = ns;
+    ac->accept = ac->first_accepting * nc;
+
+    /* the patterns each accepting state completes */
+    ac->out_off[0] = 0;
+    for (k = 0; k < num_accepting; k++)
+        ac->out_off[k + 1] = ac->out_off[k] + num_out[old_id[ac->first_accepting + k]];
+    ac->out_ids = malloc((ac->out_off[num_accepting] ? ac->out_off[num_accepting] : 1)
+                         * sizeof(*ac->out_ids));
+    if (!ac->out_ids)
+        goto fail;
+    for (k = 0; k < num_accepting; k++) {
+        i = ac->out_off[k];
+        for (s = old_id[ac->first_accepting + k]; s; s = fail[s])
+            for (p = first_term[s]; p != UINT32_MAX; p = next_term[p])
+                ac->out_ids[i++] = p;
+    }
+
+    free(go);
+    free(fail);
+    free(order);
+    free(first_term);
+    free(next_term);
+    free(num_out);
+    free(new_id);
+    free(old_id);
+    return ac;
+
+fail:
+    free(go);
+    free(fail);
+    free(order);
+    free(first_term);
+    free(next_term);
+    free(num_out);
+    free(new_id);
+    free(old_id);
+    ac_free(ac);
+    return NULL;
+}
+
+void ac_free (struct ac* ac)
+{
+    if (!ac)
+        return;
+
+    free(ac->table);
+    free(ac->out_off);
+    free(ac->out_ids);
+    free(ac->empty_ids);
+    free(ac->lens);
+    free(ac);
+}
+
+/* length of the longest pattern */
+size_t ac_max_len (const struct ac* ac)
+{
+    return ac->max_len;
+}
+
+size_t ac_num_states (const struct ac* ac)
+{
+    return ac->num_states;
+}
+
+
+/* Is pattern "id", ending at p, a whole word of buf[0..len)? */
+static inline int whole_word (const struct ac* ac, uint32_t id, const char* buf,
+                              size_t len, const char* p)
+{
+    const char* start = p + 1 - ac->lens[id];
+
+    return (start == buf || !search_is_word(start[-1]))
+        && (p + 1 == buf + len || !search_is_word(p[1]));
+}
+
+/* Does accepting state "s", reached at p, complete a pattern that is a
+ * whole word? */
+static int word_match (const struct ac* ac, uint32_t s, const char* buf, size_t len,
+                       const char* p)
+{
+    uint32_t k = s / ac->num_classes - ac->first_accepting, i;
+
+    for (i = ac->out_off[k]; i < ac->out_off[k + 1]; i++)
+        if (whole_word(ac, ac->out_ids[i], buf, len, p))
+            return 1;
+
+    return 0;
+}
+
+/* Where the empty pattern first matches in buf[0..len), which holds
+ * whole lines: anywhere on the first line or, with -w, only between two
+ * bytes neither of which is part of a word (the ends of a line count as
+ * such).  Returns a pointer to the byte after that place (the last one
+ * of the line, for a match at the very end), or NULL if there is none. */
+static const char* empty_match (const struct ac* ac, const char* buf, size_t len)
+{
+    const char* end = buf + len;
+    const char* p;
+
+    for (p = buf; p < end; p++)
+        if (!ac->words || ((p == buf || !search_is_word(p[-1])) && !search_is_word(*p)))
+            return p;
+
+    /* the end of a last line that has no newline */
+    if (len && end[-1] != '\n' && !search_is_word(end[-1]))
+        return end - 1;
+
+    return NULL;
+}
+
+/* Find the match that ends first in buf[0..len).  Returns a pointer to
+ * its last byte (to the byte after it, for an empty pattern), or NULL
+ * if no pattern occurs. */
+const char* ac_find (const struct ac* ac, const char* buf, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    const unsigned char* end = p + len;
+    const uint32_t* table = ac->table;
+    const uint8_t* classes = ac->classes;
+    uint32_t s = 0, accept = ac->accept;
+    const char* empty = NULL;
+
+    /* only a pattern that ends before the empty one matters */
+    if (ac->num_empty && (empty = empty_match(ac, buf, len)) != NULL)
+        end = (const unsigned char*)empty;
+
+    for (; p < end; p++) {
+        s = table[s + classes[*p]];
+        if (s >= accept && (!ac->words || word_match(ac, s, buf, len, (const char*)p)))
+            return (const char*)p;
+    }
+
+    return empty;
+}
+
+/* Count the matching line line[0..len) once for every pattern on it */
+void ac_tally_line (const struct ac* ac, const char* line, size_t len, struct ac_tally* t)
+{
+    const unsigned char* p = (const unsigned char*)line;
+    const unsigned char* end = p + len;
+    uint32_t s = 0, i, id, k;
+
+    if (!t->lines) {
+        t->lines = calloc(ac->num_patterns, sizeof(*t->lines));
+        t->seen = calloc(ac->num_patterns, sizeof(*t->seen));
+        if (!t->lines || !t->seen) {
+            ac_tally_free(t);
+            return;
+        }
+    }
+
+    if (++t->stamp == 0) {
+        memset(t->seen, 0, ac->num_patterns * sizeof(*t->seen));
+        t->stamp = 1;
+    }
+
+    if (ac->num_empty && empty_match(ac, line, len))
+        for (i = 0; i < ac->num_empty; i++)
+            t->lines[ac->empty_ids[i]]++;
+
+    for (; p < end; p++) {
+        s = ac->table[s + ac->classes[*p]];
+        if (s < ac->accept)
+            continue;
+
+        k = s / ac->num_classes - ac->first_accepting;
+        for (i = ac->out_off[k]; i < ac->out_off[k + 1]; i++) {
+            id = ac->out_ids[i];
+            if (ac->words && !whole_word(ac, id, line, len, (const char*)p))
+                continue;
+            if (t->seen[id] != t->stamp) {
+                t->seen[id] = t->stamp;
+                t->lines[id]++;
+            }
+        }
+    }
+}
+
+void ac_tally_free (struct ac_tally* t)
+{
+    free(t->lines);
+    free(t->seen);
+    t->lines = NULL;
+    t->seen = NULL;
+}
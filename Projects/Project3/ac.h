@@ -0,0 +1,29 @@
+#ifndef _ac_h_
+#define _ac_h_
+
+#include <stddef.h>
+
+struct ac;
+
+/* ac_build flags */
+#define AC_ICASE 0x1            /* ignore ASCII case (-i) */
+#define AC_WORDS 0x2            /* only matches that are whole words (-w) */
+
+/* A thread's count of the lines each pattern was found on */
+struct ac_tally {
+    unsigned long* lines;       /* per pattern, allocated on first use */
+    unsigned int* seen;         /* stamp of the last line counted */
+    unsigned int stamp;
+};
+
+struct ac* ac_build (char* const* patterns, size_t num, int flags);
+void ac_free (struct ac* ac);
+size_t ac_max_len (const struct ac* ac);
+size_t ac_num_states (const struct ac* ac);
+
+const char* ac_find (const struct ac* ac, const char* buf, size_t len);
+void ac_tally_line (const struct ac* ac, const char* line, size_t len,
+                    struct ac_tally* t);
+void ac_tally_free (struct ac_tally* t);
+
+#endif /* _ac_h_ */
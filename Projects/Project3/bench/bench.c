@@ -0,0 +1,448 @@
+/******************************************************************************
+ * bench - benchmark the minigrep search engines on a synthetic tree
+ *
+ * Generates a reproducible directory tree (the same options and seed
+ * always give byte-identical files), then runs minigrep over it with
+ * every engine asked for, both with a warm page cache and with the
+ * tree's pages dropped from the cache first.  Each run is reported as
+ * a line of CSV on stdout:
+ *
+ *   engine,cache,run,files,bytes,seconds,files_per_sec,mb_per_sec,p50_us,p99_us
+ *
+ * where the file and byte counts and the per-file latency percentiles
+ * come from minigrep's --file-times report.
+ *
+ * Compile with:
+ *   $ make bench
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define NEEDLE "minigrepbenchneedle"
+#define MAX_ENGINES 16
+#define MAX_ENGINE_ARGS 8
+
+/* remembers what a generated tree was made from, so it can be reused.
+ * It goes next to the tree, named after it, rather than in it where it
+ * would be searched along with the rest */
+#define STAMP_SUFFIX ".bench-tree"
+
+struct params {
+    unsigned int depth;         /* directory levels below the root */
+    unsigned int fanout;        /* subdirectories per directory */
+    unsigned int files;         /* files per directory */
+    unsigned long min_size;     /* file sizes are log-uniform in */
+    unsigned long max_size;     /*   [min_size, max_size] */
+    double density;             /* fraction of lines holding the needle */
+    unsigned long seed;
+};
+
+struct result {
+    unsigned long files;
+    unsigned long long bytes;
+    unsigned int p50_us;
+    unsigned int p99_us;
+    double seconds;
+};
+
+static const char* words[] = {
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "static",
+    "void", "return", "struct", "while", "for", "int", "char", "error",
+    "warning", "buffer", "queue", "thread", "worker", "file", "path", "line",
+    "match", "string", "index", "scan", "directory", "lorem", "ipsum"
+};
+
+static uint64_t rng_state;
+
+
+/***** SYNTHETIC TREE ********************************/
+static uint64_t rng_next (void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static double rng_uniform (void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* a size drawn log-uniformly from [min, max], so that there are many
+ * small files and a few big ones, as in a real source tree */
+static unsigned long rng_size (unsigned long min, unsigned long max)
+{
+    double lo, hi, x;
+
+    if (max <= min)
+        return min;
+
+    lo = log(min ? min : 1);
+    hi = log(max);
+    x = exp(lo + (hi - lo) * rng_uniform());
+
+    return x < min ? min : x > max ? max : (unsigned long)x;
+}
+
+static int write_file (const char* path, const struct params* p)
+{
+    unsigned long size, len = 0;
+    char line[256];
+    int n, i, num_words;
+    FILE* fp;
+
+    fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+
+    size = rng_size(p->min_size, p->max_size);
+    while (len < size) {
+        n = 0;
+        num_words = 4 + rng_next() % 12;
+        for (i = 0; i < num_words; i++)
+            n += sprintf(line + n, "%s ",
+                         words[rng_next() % (sizeof(words) / sizeof(*words))]);
+        if (rng_uniform() < p->density)
+            n += sprintf(line + n, "%s ", NEEDLE);
+        line[n - 1] = '\n';
+
+        fwrite(line, 1, n, fp);
+        len += n;
+    }
+
+    return fclose(fp);
+}
+
+static int make_dir (char* path, size_t len, unsigned int level, const struct params* p)
+{
+    unsigned int i;
+
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        return -1;
+
+    for (i = 0; i < p->files; i++) {
+        snprintf(path + len, PATH_MAX - len, "/f%u.txt", i);
+        if (write_file(path, p) < 0)
+            return -1;
+    }
+
+    if (level < p->depth) {
+        for (i = 0; i < p->fanout; i++) {
+            snprintf(path + len, PATH_MAX - len, "/d%u", i);
+            if (make_dir(path, strlen(path), level + 1, p) < 0)
+                return -1;
+        }
+    }
+    path[len] = '\0';
+
+    return 0;
+}
+
+static void params_string (char* buf, size_t size, const struct params* p)
+{
+    snprintf(buf, size, "depth=%u fanout=%u files=%u min-size=%lu max-size=%lu "
+             "density=%g seed=%lu\n", p->depth, p->fanout, p->files,
+             p->min_size, p->max_size, p->density, p->seed);
+}
+
+/* the stamp of the tree in "dir": "dir.bench-tree" */
+static void stamp_path (char* buf, size_t size, const char* dir)
+{
+    size_t len = strlen(dir);
+
+    while (len > 1 && dir[len - 1] == '/')
+        len--;
+    snprintf(buf, size, "%.*s%s", (int)len, dir, STAMP_SUFFIX);
+}
+
+/* Generate the tree in "dir", or reuse it if an earlier run already
+ * generated it with the same parameters */
+static int generate_tree (const char* dir, const struct params* p)
+{
+    char path[PATH_MAX], stamp[PATH_MAX];
+    char want[256], have[256] = "";
+    FILE* fp;
+
+    params_string(want, sizeof(want), p);
+    stamp_path(stamp, sizeof(stamp), dir);
+
+    if (access(dir, F_OK) == 0) {
+        fp = fopen(stamp, "r");
+        if (!fp) {
+            fprintf(stderr, "error -- %s exists and isn't a benchmark tree\n", dir);
+            return -1;
+        }
+        if (!fgets(have, sizeof(have), fp))
+            have[0] = '\0';
+        fclose(fp);
+        if (!strcmp(want, have))
+            return 0;
+        fprintf(stderr, "error -- %s holds a tree generated with other parameters; "
+                "remove it first\n", dir);
+        return -1;
+    }
+
+    fprintf(stderr, "generating %s: %s", dir, want);
+    rng_state = p->seed ? p->seed : 1;
+    snprintf(path, sizeof(path), "%s", dir);
+    if (make_dir(path, strlen(path), 0, p) < 0) {
+        perror(path);
+        return -1;
+    }
+
+    fp = fopen(stamp, "w");
+    if (!fp || fputs(want, fp) == EOF || fclose(fp) != 0) {
+        perror(stamp);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/***** CACHE CONTROL *********************************/
+static int drop_file (const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    int fd;
+
+    if (flag != FTW_F)
+        return 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    return 0;
+}
+
+/* Get the tree out of the page cache.  As root we can drop every clean
+ * page and dentry; otherwise we ask for each file's pages to go. */
+static void drop_caches (const char* dir)
+{
+    int fd;
+
+    sync();
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "3", 1) == 1) {
+            close(fd);
+            return;
+        }
+        close(fd);
+    }
+
+    nftw(dir, drop_file, 64, FTW_PHYS);
+}
+
+
+/***** RUNNING MINIGREP ******************************/
+static double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run "minigrep <engine...> --file-times dir NEEDLE" once */
+static int run_once (const char* minigrep, char* engine, const char* dir,
+                     struct result* r)
+{
+    char* argv[MAX_ENGINE_ARGS + 5];
+    char buf[4096];
+    char* copy;
+    char* tok;
+    char* line;
+    size_t len = 0;
+    ssize_t n;
+    int argc = 0, pipefd[2], status, null;
+    double start;
+    pid_t pid;
+
+    copy = strdup(engine);
+    if (!copy)
+        return -1;
+
+    argv[argc++] = (char*)minigrep;
+    for (tok = strtok(copy, " "); tok && argc < MAX_ENGINE_ARGS + 1;
+            tok = strtok(NULL, " "))
+        argv[argc++] = tok;
+    argv[argc++] = "--file-times";
+    argv[argc++] = (char*)dir;
+    argv[argc++] = NEEDLE;
+    argv[argc] = NULL;
+
+    if (pipe(pipefd) < 0) {
+        free(copy);
+        return -1;
+    }
+
+    start = now();
+    pid = fork();
+    if (pid == 0) {
+        null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        close(pipefd[0]);
+        execv(minigrep, argv);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    free(copy);
+
+    if (pid < 0) {
+        close(pipefd[0]);
+        return -1;
+    }
+
+    while ((n = read(pipefd[0], buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += n;
+        if (len == sizeof(buf) - 1) {
+            /* keep only the tail; the report comes last */
+            memmove(buf, buf + len / 2, len - len / 2);
+            len -= len / 2;
+        }
+    }
+    close(pipefd[0]);
+    waitpid(pid, &status, 0);
+    r->seconds = now() - start;
+    buf[len] = '\0';
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "error -- %s %s failed\n", minigrep, engine);
+        return -1;
+    }
+
+    line = strstr(buf, "file-times:");
+    if (!line || sscanf(line, "file-times: files=%lu bytes=%llu p50_us=%u p99_us=%u",
+                        &r->files, &r->bytes, &r->p50_us, &r->p99_us) != 4) {
+        fprintf(stderr, "error -- no --file-times report from %s %s\n", minigrep, engine);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void print_usage (char* prog)
+{
+    printf("Usage: %s [options] [-- engine ...]\n\n", prog);
+    printf("    engine  -   minigrep mode flags to benchmark, e.g. \"-S\" or\n");
+    printf("                   \"-P --sorted\" (default: -S -P -U)\n\n");
+    printf("Options:\n");
+    printf("    --minigrep=PATH     minigrep binary (default ./minigrep)\n");
+    printf("    --dir=DIR           where to generate the tree\n");
+    printf("                           (default /tmp/minigrep-bench)\n");
+    printf("    --depth=N           directory levels (default 3)\n");
+    printf("    --fanout=N          subdirectories per directory (default 4)\n");
+    printf("    --files=N           files per directory (default 16)\n");
+    printf("    --min-size=BYTES    smallest file (default 256)\n");
+    printf("    --max-size=BYTES    biggest file (default 1048576)\n");
+    printf("    --density=F         fraction of lines that match (default 0.01)\n");
+    printf("    --seed=N            generator seed (default 1)\n");
+    printf("    --runs=N            runs per engine and cache state (default 5)\n\n");
+}
+
+int main (int argc, char** argv)
+{
+    struct params p = {
+        .depth = 3, .fanout = 4, .files = 16,
+        .min_size = 256, .max_size = 1 << 20,
+        .density = 0.01, .seed = 1
+    };
+    static const struct option long_options[] = {
+        { "minigrep", required_argument, NULL, 'm' },
+        { "dir", required_argument, NULL, 'd' },
+        { "depth", required_argument, NULL, 'D' },
+        { "fanout", required_argument, NULL, 'F' },
+        { "files", required_argument, NULL, 'f' },
+        { "min-size", required_argument, NULL, 's' },
+        { "max-size", required_argument, NULL, 'S' },
+        { "density", required_argument, NULL, 'x' },
+        { "seed", required_argument, NULL, 'r' },
+        { "runs", required_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+    char* default_engines[] = { "-S", "-P", "-U" };
+    char** engines = default_engines;
+    const char* minigrep = "./minigrep";
+    const char* dir = "/tmp/minigrep-bench";
+    unsigned int runs = 5, num_engines = 3, e, cold, i;
+    struct result r;
+    int c, ret = EXIT_SUCCESS;
+
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'm': minigrep = optarg; break;
+        case 'd': dir = optarg; break;
+        case 'D': p.depth = strtoul(optarg, NULL, 0); break;
+        case 'F': p.fanout = strtoul(optarg, NULL, 0); break;
+        case 'f': p.files = strtoul(optarg, NULL, 0); break;
+        case 's': p.min_size = strtoul(optarg, NULL, 0); break;
+        case 'S': p.max_size = strtoul(optarg, NULL, 0); break;
+        case 'x': p.density = strtod(optarg, NULL); break;
+        case 'r': p.seed = strtoul(optarg, NULL, 0); break;
+        case 'n': runs = strtoul(optarg, NULL, 0); break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* engine flags start with "-", so they follow a "--" */
+    if (optind < argc) {
+        engines = argv + optind;
+        num_engines = argc - optind;
+        if (num_engines > MAX_ENGINES)
+            num_engines = MAX_ENGINES;
+    }
+
+    if (generate_tree(dir, &p) < 0)
+        return EXIT_FAILURE;
+
+    printf("engine,cache,run,files,bytes,seconds,files_per_sec,mb_per_sec,"
+           "p50_us,p99_us\n");
+    for (e = 0; e < num_engines; e++) {
+        for (cold = 0; cold < 2; cold++) {
+            /* one untimed run to warm the cache up */
+            if (!cold && run_once(minigrep, engines[e], dir, &r) < 0) {
+                ret = EXIT_FAILURE;
+                break;
+            }
+
+            for (i = 0; i < runs; i++) {
+                if (cold)
+                    drop_caches(dir);
+                if (run_once(minigrep, engines[e], dir, &r) < 0) {
+                    ret = EXIT_FAILURE;
+                    break;
+                }
+                printf("%s,%s,%u,%lu,%llu,%.6f,%.1f,%.2f,%u,%u\n", engines[e],
+                       cold ? "cold" : "warm", i + 1, r.files, r.bytes, r.seconds,
+                       r.files / r.seconds, r.bytes / r.seconds / (1 << 20),
+                       r.p50_us, r.p99_us);
+                fflush(stdout);
+            }
+        }
+    }
+
+    return ret;
+}
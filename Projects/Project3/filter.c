@@ -0,0 +1,448 @@
+/******************************************************************************
+ * filter.c - include/exclude globs and .gitignore rules for minigrep
+ *
+ * Every pattern is compiled once, when it is added, into the cheapest
+ * test that decides it: most real-world patterns ("*.o", "node_modules",
+ * "build/") come down to a string compare or a suffix compare, and only
+ * the rest go through the general glob matcher.  The traversal asks
+ * filter_skip about each directory entry before posting it, so excluded
+ * subtrees are never opened, listed or stat'ed.
+ *
+ * Globs support "*" and "?" (neither matches "/"), "[...]" classes and,
+ * in .gitignore files, "**" spanning any number of directories.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include "filter.h"
+#include "path.h"
+
+/* how a compiled glob is tested */
+enum glob_kind {
+    GLOB_LITERAL,               /* no wildcards: plain string compare */
+    GLOB_SUFFIX,                /* "*" then a literal: suffix compare */
+    GLOB_GENERAL                /* anything else: glob_match */
+};
+
+struct glob {
+    enum glob_kind kind;
+    const char* lit;            /* literal part for LITERAL/SUFFIX */
+    size_t lit_len;
+    char* pattern;
+    int negate;                 /* gitignore "!pattern" */
+    int dir_only;               /* gitignore "pattern/" */
+    int anchored;               /* has a "/": match the relative path */
+};
+
+struct glob_list {
+    struct glob* globs;
+    size_t num;
+    size_t max;
+};
+
+struct ignore {
+    struct glob_list rules;
+    int anchored;               /* any rule needs the relative path */
+};
+
+static struct glob_list filters[3];
+static int use_gitignore;
+
+
+/* does "c" match the glob class starting at *pp (just past the "[")?
+ * On return *pp points past the closing "]". */
+static int class_match (const char** pp, char c)
+{
+    const char* p = *pp;
+    int negate = 0, match = 0;
+    char lo, hi;
+
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+
+    /* a "]" right at the start is part of the class */
+    do {
+        lo = *p++;
+        if (lo == '\\' && *p)
+            lo = *p++;
+        hi = lo;
+        if (*p == '-' && p[1] && p[1] != ']') {
+            hi = p[1];
+            p += 2;
+            if (hi == '\\' && *p)
+                hi = *p++;
+        }
+        if (lo <= c && c <= hi)
+            match = 1;
+    } while (*p && *p != ']');
+
+    *pp = *p ? p + 1 : p;
+
+    return match != negate;
+}
+
+static int glob_match (const char* p, const char* s)
+{
+    const char* start;
+
+    while (1) {
+        switch (*p) {
+        case '\0':
+            return !*s;
+
+        case '*':
+            if (p[1] == '*') {
+                /* "**" also crosses directories, and "**" followed by
+                 * "/" may match nothing at all */
+                p += 2;
+                if (*p == '/' && glob_match(p + 1, s))
+                    return 1;
+                for (; *s; s++)
+                    if (glob_match(p, s))
+                        return 1;
+                return glob_match(p, s);
+            }
+
+            p++;
+            for (;; s++) {
+                if (glob_match(p, s))
+                    return 1;
+                if (!*s || *s == '/')
+                    return 0;
+            }
+
+        case '?':
+            if (!*s || *s == '/')
+                return 0;
+            p++;
+            s++;
+            break;
+
+        case '[':
+            start = p + 1;
+            if (!*s || *s == '/' || !*start)
+                return 0;
+            if (!class_match(&start, *s))
+                return 0;
+            p = start;
+            s++;
+            break;
+
+        case '\\':
+            if (p[1])
+                p++;
+            /* fall through */
+        default:
+            if (*p != *s)
+                return 0;
+            p++;
+            s++;
+            break;
+        }
+    }
+}
+
+/* Compile "pattern" (len bytes, not necessarily terminated) into g.
+ * Only .gitignore rules have "!", a trailing "/" and anchoring. */
+static int glob_compile (struct glob* g, const char* pattern, size_t len, int gitignore)
+{
+    memset(g, 0, sizeof(*g));
+
+    if (gitignore && len && pattern[0] == '!') {
+        g->negate = 1;
+        pattern++;
+        len--;
+    }
+    if (gitignore && len > 1 && pattern[len - 1] == '/') {
+        g->dir_only = 1;
+        len--;
+    }
+    if (gitignore && memchr(pattern, '/', len)) {
+        g->anchored = 1;
+        if (pattern[0] == '/') {
+            pattern++;
+            len--;
+        }
+    }
+
+    g->pattern = strndup(pattern, len);
+    if (!g->pattern)
+        return -1;
+
+    if (!strpbrk(g->pattern, "*?[\\")) {
+        g->kind = GLOB_LITERAL;
+        g->lit = g->pattern;
+        g->lit_len = len;
+    }
+    else if (g->pattern[0] == '*' && !strpbrk(g->pattern + 1, "*?[\\/")) {
+        g->kind = GLOB_SUFFIX;
+        g->lit = g->pattern + 1;
+        g->lit_len = len - 1;
+    }
+    else
+        g->kind = GLOB_GENERAL;
+
+    return 0;
+}
+
+static int glob_test (const struct glob* g, const char* s, size_t len)
+{
+    switch (g->kind) {
+    case GLOB_LITERAL:
+        return len == g->lit_len && !memcmp(s, g->lit, len);
+    case GLOB_SUFFIX:
+        return len >= g->lit_len && !memcmp(s + len - g->lit_len, g->lit, g->lit_len);
+    default:
+        return glob_match(g->pattern, s);
+    }
+}
+
+static int glob_list_add (struct glob_list* list, const char* pattern, size_t len,
+                          int gitignore)
+{
+    struct glob* globs;
+    size_t max;
+
+    if (list->num == list->max) {
+        max = list->max ? 2 * list->max : 8;
+        globs = realloc(list->globs, max * sizeof(*globs));
+        if (!globs)
+            return -1;
+        list->globs = globs;
+        list->max = max;
+    }
+
+    if (glob_compile(&list->globs[list->num], pattern, len, gitignore) < 0)
+        return -1;
+    list->num++;
+
+    return 0;
+}
+
+static int glob_list_any (const struct glob_list* list, const char* name, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < list->num; i++)
+        if (glob_test(&list->globs[i], name, len))
+            return 1;
+
+    return 0;
+}
+
+
+/***** COMMAND LINE FILTERS **************************/
+int filter_add (enum filter_kind kind, const char* glob)
+{
+    return glob_list_add(&filters[kind], glob, strlen(glob), 0);
+}
+
+void filter_use_gitignore (void)
+{
+    use_gitignore = 1;
+}
+
+int filter_gitignore (void)
+{
+    return use_gitignore;
+}
+
+/* is there anything to filter at all? */
+int filter_active (void)
+{
+    return use_gitignore || filters[FILTER_INCLUDE].num || filters[FILTER_EXCLUDE].num
+           || filters[FILTER_EXCLUDE_DIR].num;
+}
+
+/* the --include/--exclude/--exclude-dir verdict on a name */
+static int filter_name (const char* name, size_t len, int is_dir)
+{
+    if (is_dir)
+        return glob_list_any(&filters[FILTER_EXCLUDE_DIR], name, len);
+
+    if (filters[FILTER_INCLUDE].num
+            && !glob_list_any(&filters[FILTER_INCLUDE], name, len))
+        return 1;
+
+    return glob_list_any(&filters[FILTER_EXCLUDE], name, len);
+}
+
+
+/***** .gitignore ************************************/
+/* Read the .gitignore in the directory "dirfd", if there is one */
+struct ignore* ignore_load (int dirfd)
+{
+    struct ignore* ig = NULL;
+    char* buf = NULL;
+    char* line;
+    char* end;
+    char* next;
+    size_t len = 0, size = 0;
+    ssize_t n;
+    int fd;
+
+    fd = openat(dirfd, ".gitignore", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    do {
+        if (len == size) {
+            size = size ? 2 * size : 4096;
+            line = realloc(buf, size + 1);
+            if (!line)
+                goto out;
+            buf = line;
+        }
+        n = read(fd, buf + len, size - len);
+        if (n > 0)
+            len += n;
+    } while (n > 0);
+    if (n < 0 || !len)
+        goto out;
+    buf[len] = '\0';
+
+    ig = calloc(1, sizeof(*ig));
+    if (!ig)
+        goto out;
+
+    for (line = buf; line < buf + len; line = next) {
+        end = memchr(line, '\n', buf + len - line);
+        if (!end)
+            end = buf + len;
+        next = end + 1;
+
+        /* trailing blanks (and a CR) don't count unless escaped */
+        while (end > line && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')
+                && !(end - 1 > line && end[-2] == '\\'))
+            end--;
+
+        if (end == line || line[0] == '#')
+            continue;
+        if (line[0] == '\\' && (line[1] == '#' || line[1] == '!'))
+            line++;
+
+        if (glob_list_add(&ig->rules, line, end - line, 1) < 0)
+            break;
+        if (ig->rules.globs[ig->rules.num - 1].anchored)
+            ig->anchored = 1;
+    }
+
+    if (!ig->rules.num) {
+        ignore_free(ig);
+        ig = NULL;
+    }
+
+out:
+    free(buf);
+    close(fd);
+    return ig;
+}
+
+void ignore_free (struct ignore* ig)
+{
+    size_t i;
+
+    if (!ig)
+        return;
+
+    for (i = 0; i < ig->rules.num; i++)
+        free(ig->rules.globs[i].pattern);
+    free(ig->rules.globs);
+    free(ig);
+}
+
+/* Write the path of "name" in "dir" relative to "base" (an ancestor of
+ * dir, or dir itself) into buf.  Returns its length, or -1 if it
+ * doesn't fit. */
+static long relative_path (char* buf, size_t size, const struct dir_ref* base,
+                           const struct dir_ref* dir, const char* name, size_t len)
+{
+    const struct dir_ref* ref;
+    size_t total = len;
+    char* p;
+
+    for (ref = dir; ref != base; ref = ref->parent)
+        total += ref->len + 1;
+    if (total >= size)
+        return -1;
+
+    p = buf + total;
+    *p = '\0';
+    p -= len;
+    memcpy(p, name, len);
+    for (ref = dir; ref != base; ref = ref->parent) {
+        *--p = '/';
+        p -= ref->len;
+        memcpy(p, ref->name, ref->len);
+    }
+
+    return total;
+}
+
+/* Check "name" in "dir" against the .gitignore files of dir and its
+ * ancestors.  A deeper file overrides a shallower one, and within a
+ * file the last matching rule wins.  Returns 1 if ignored, 0 if
+ * explicitly re-included and -1 if no rule says anything. */
+static int ignore_check (const struct dir_ref* dir, const char* name, size_t len,
+                         int is_dir)
+{
+    const struct dir_ref* base;
+    const struct glob* g;
+    char rel[PATH_MAX];
+    long rel_len;
+    size_t i;
+
+    for (base = dir; base; base = base->parent) {
+        if (!base->ignore)
+            continue;
+
+        rel_len = -1;
+        if (base->ignore->anchored)
+            rel_len = relative_path(rel, sizeof(rel), base, dir, name, len);
+
+        for (i = base->ignore->rules.num; i-- > 0; ) {
+            g = &base->ignore->rules.globs[i];
+            if (g->dir_only && !is_dir)
+                continue;
+
+            if (g->anchored) {
+                if (rel_len < 0 || !glob_test(g, rel, rel_len))
+                    continue;
+            }
+            else if (!glob_test(g, name, len))
+                continue;
+
+            return !g->negate;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Should the entry "name" of type "type" (a known DT_* type) in the
+ * directory "dir" be left out of the search? */
+int filter_skip (const struct dir_ref* dir, const char* name, unsigned char type)
+{
+    size_t len = strlen(name);
+    int is_dir = type == DT_DIR;
+
+    if (filter_name(name, len, is_dir))
+        return 1;
+
+    if (use_gitignore) {
+        if (is_dir && !strcmp(name, ".git"))
+            return 1;
+        if (ignore_check(dir, name, len, is_dir) == 1)
+            return 1;
+    }
+
+    return 0;
+}
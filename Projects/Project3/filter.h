@@ -0,0 +1,27 @@
+#ifndef _filter_h_
+#define _filter_h_
+
+#include <stddef.h>
+
+struct dir_ref;
+
+enum filter_kind {
+    FILTER_INCLUDE,             /* --include: search only matching files */
+    FILTER_EXCLUDE,             /* --exclude: don't search matching files */
+    FILTER_EXCLUDE_DIR          /* --exclude-dir: don't descend into dirs */
+};
+
+/* the rules of one .gitignore file */
+struct ignore;
+
+int filter_add (enum filter_kind kind, const char* glob);
+void filter_use_gitignore (void);
+int filter_active (void);
+int filter_gitignore (void);
+
+int filter_skip (const struct dir_ref* dir, const char* name, unsigned char type);
+
+struct ignore* ignore_load (int dirfd);
+void ignore_free (struct ignore* ig);
+
+#endif /* _filter_h_ */
@@ -0,0 +1,102 @@
+/******************************************************************************
+ * fuzzy.c - approximate string matching for minigrep (--fuzzy=K)
+ *
+ * Finds the places where the string occurs with at most K edits
+ * (characters inserted, deleted or replaced), using Myers' bit-vector
+ * algorithm: the column of the edit distance table for the text read so
+ * far is kept as two words of vertical +1/-1 deltas, one bit per byte
+ * of the string, and advancing it by a byte of text takes a dozen word
+ * operations whatever K is.  The distance of the best match ending at
+ * the current byte falls out of the top bit, so the search is a single
+ * pass over the buffer with no backtracking.  Strings are limited to
+ * the 64 bytes of a word.
+ *
+ * Matches never span lines: the column starts over at every newline.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "fuzzy.h"
+
+struct fuzzy {
+    uint64_t peq[256];          /* bit i set where string[i] is that byte */
+    uint64_t last;              /* the bit of the string's last byte */
+    unsigned int len;
+    unsigned int k;             /* most edits a match may take */
+};
+
+
+/* Set up the search for string[0..len), 0 < len <= FUZZY_MAX_LEN, with
+ * up to "k" edits and FUZZY_* "flags".  Returns NULL if out of memory. */
+struct fuzzy* fuzzy_new (const char* string, size_t len, unsigned int k, int flags)
+{
+    struct fuzzy* f;
+    unsigned char c;
+    size_t i;
+
+    f = calloc(1, sizeof(*f));
+    if (!f)
+        return NULL;
+
+    for (i = 0; i < len; i++) {
+        c = string[i];
+        f->peq[c] |= (uint64_t)1 << i;
+        if (flags & FUZZY_ICASE && (c | 0x20) - 'a' < 26u)
+            f->peq[c ^ 0x20] |= (uint64_t)1 << i;
+    }
+    f->last = (uint64_t)1 << (len - 1);
+    f->len = len;
+    f->k = k;
+
+    return f;
+}
+
+void fuzzy_free (struct fuzzy* f)
+{
+    free(f);
+}
+
+/* Find the first place in buf[0..len) where a match within k edits
+ * ends.  Returns a pointer to its last byte, or NULL if there is none. */
+const char* fuzzy_find (const struct fuzzy* f, const char* buf, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    const unsigned char* end = p + len;
+    const uint64_t last = f->last;
+    uint64_t pv = ~(uint64_t)0, mv = 0, eq, xv, xh, ph, mh;
+    unsigned int score = f->len;
+
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            pv = ~(uint64_t)0;
+            mv = 0;
+            score = f->len;
+            continue;
+        }
+
+        /* the horizontal deltas along the new column... */
+        eq = f->peq[*p];
+        xv = eq | mv;
+        xh = (((eq & pv) + pv) ^ pv) | eq;
+        ph = mv | ~(xh | pv);
+        mh = pv & xh;
+
+        /* ...the bottom one of which moves the match's distance
+         * (they are never both set)... */
+        score += (ph & last) != 0;
+        score -= (mh & last) != 0;
+
+        /* ...and give its vertical ones.  Nothing is shifted in at the
+         * top, as a match may start anywhere at no cost. */
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        if (score <= f->k)
+            return (const char*)p;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,18 @@
+#ifndef _fuzzy_h_
+#define _fuzzy_h_
+
+#include <stddef.h>
+
+/* the longest string --fuzzy can take: one bit per byte of a word */
+#define FUZZY_MAX_LEN 64
+
+/* fuzzy_new flags */
+#define FUZZY_ICASE 0x1         /* ignore ASCII case (-i) */
+
+struct fuzzy;
+
+struct fuzzy* fuzzy_new (const char* string, size_t len, unsigned int k, int flags);
+void fuzzy_free (struct fuzzy* f);
+const char* fuzzy_find (const struct fuzzy* f, const char* buf, size_t len);
+
+#endif /* _fuzzy_h_ */
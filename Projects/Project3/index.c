@@ -0,0 +1,710 @@
+/******************************************************************************
+ * index.c - persistent trigram index for minigrep
+ *
+ * The index maps every 3-byte sequence (trigram) occurring in the files
+ * of a tree to the sorted list of files it occurs in.  A string of three
+ * or more bytes can only be in a file that contains all of its trigrams,
+ * so intersecting the string's posting lists gives a short list of
+ * candidate files for the exact matcher to check, instead of the whole
+ * tree.  Trigrams are recorded with ASCII letters folded to lower case,
+ * which makes the candidate list a superset of the files that match in
+ * any letter case.
+ *
+ * The file is written once by the builder and then only ever mapped
+ * read only; it is written under a temporary name and renamed into
+ * place, so a search running during a rebuild or an update keeps using
+ * the old index.  An update reuses the posting data of every file whose
+ * inode, mtime and size are unchanged and only reads the rest.
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "index.h"
+
+#define TRIGRAM_SPACE (1u << 24)
+
+/* key of the posting list holding the unindexed files; it sorts after
+ * every real trigram */
+#define TRIGRAM_UNINDEXED TRIGRAM_SPACE
+
+struct index_builder {
+    struct index_file* files;
+    size_t num_files;
+    size_t max_files;
+
+    /* root, then the relative file names, NUL terminated */
+    char* names;
+    size_t names_len;
+    size_t names_size;
+
+    /* one (trigram << 32 | file id) pair for each distinct trigram of
+     * each file, in file id order */
+    uint64_t* pairs;
+    size_t num_pairs;
+    size_t max_pairs;
+
+    /* pairs aren't in file id order (files were reused) */
+    int unordered;
+
+    /* trigrams already seen in the file being added */
+    uint64_t* seen;
+
+    /* the index being updated and, for each of its files that is
+     * reused, 1 + the file's new id */
+    struct index* old;
+    uint32_t* remap;
+};
+
+struct index {
+    char* map;
+    size_t size;
+    const struct index_header* hdr;
+    const struct index_file* files;
+    const struct index_trigram* trigrams;
+    const uint32_t* postings;
+    const char* names;
+
+    /* name lookup: 1 + file id, or 0 for an empty slot */
+    uint32_t* table;
+    size_t table_mask;
+};
+
+
+static inline uint32_t fold (unsigned char c)
+{
+    return c - 'A' < 26u ? c | 0x20 : c;
+}
+
+static int grow (void** array, size_t* max, size_t need, size_t elem)
+{
+    size_t n = *max ? *max : 1024;
+    void* p;
+
+    if (need <= *max)
+        return 0;
+
+    while (n < need)
+        n *= 2;
+
+    p = realloc(*array, n * elem);
+    if (!p)
+        return -1;
+
+    *array = p;
+    *max = n;
+
+    return 0;
+}
+
+static int add_name (struct index_builder* b, const char* name, uint64_t* off)
+{
+    size_t len = strlen(name) + 1;
+
+    if (grow((void**)&b->names, &b->names_size, b->names_len + len, 1) < 0)
+        return -1;
+
+    memcpy(b->names + b->names_len, name, len);
+    *off = b->names_len;
+    b->names_len += len;
+
+    return 0;
+}
+
+
+static int64_t mtime_ns (const struct stat* st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+
+/***** BUILDING **************************************/
+/* append a new entry to the file table */
+static struct index_file* add_file (struct index_builder* b, const char* name,
+                                    const struct stat* st)
+{
+    struct index_file* file;
+
+    if (grow((void**)&b->files, &b->max_files, b->num_files + 1, sizeof(*b->files)) < 0)
+        return NULL;
+
+    file = &b->files[b->num_files];
+    memset(file, 0, sizeof(*file));
+    if (add_name(b, name, &file->name_off) < 0)
+        return NULL;
+    file->ino = st->st_ino;
+    file->mtime_ns = mtime_ns(st);
+    file->size = st->st_size;
+    b->num_files++;
+
+    return file;
+}
+
+/* Start a new index for the tree at "root" (as given on the command
+ * line; the index records its canonical path) */
+struct index_builder* index_builder_new (const char* root)
+{
+    struct index_builder* b;
+    char* real;
+    uint64_t off;
+
+    b = calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+
+    b->seen = calloc(TRIGRAM_SPACE / 64, sizeof(uint64_t));
+    real = realpath(root, NULL);
+    if (!b->seen || !real || add_name(b, real, &off) < 0) {
+        free(real);
+        index_builder_free(b);
+        return NULL;
+    }
+    free(real);
+
+    return b;
+}
+
+/* Add the file "name" (relative to the root), described by "st", whose
+ * contents are buf[0..len).  An unindexed file has no trigrams recorded
+ * and is a candidate for every search. */
+int index_builder_add (struct index_builder* b, const char* name, const struct stat* st,
+                       const char* buf, size_t len, int unindexed)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    struct index_file* file;
+    uint32_t id = b->num_files;
+    uint32_t t;
+    size_t i, first;
+    int ret = 0;
+
+    file = add_file(b, name, st);
+    if (!file)
+        return -1;
+
+    if (unindexed) {
+        file->flags |= INDEX_FILE_UNINDEXED;
+        if (grow((void**)&b->pairs, &b->max_pairs, b->num_pairs + 1,
+                 sizeof(*b->pairs)) < 0)
+            return -1;
+        b->pairs[b->num_pairs++] = (uint64_t)TRIGRAM_UNINDEXED << 32 | id;
+        return 0;
+    }
+
+    if (len < 3)
+        return 0;
+
+    first = b->num_pairs;
+    t = fold(p[0]) << 8 | fold(p[1]);
+    for (i = 2; i < len; i++) {
+        t = (t << 8 | fold(p[i])) & (TRIGRAM_SPACE - 1);
+        if (b->seen[t / 64] & (1ull << (t % 64)))
+            continue;
+        b->seen[t / 64] |= 1ull << (t % 64);
+
+        if (b->num_pairs == b->max_pairs
+                && grow((void**)&b->pairs, &b->max_pairs, b->num_pairs + 1,
+                        sizeof(*b->pairs)) < 0) {
+            ret = -1;
+            break;
+        }
+        b->pairs[b->num_pairs++] = (uint64_t)t << 32 | id;
+    }
+
+    /* clear the bitmap for the next file */
+    for (i = first; i < b->num_pairs; i++) {
+        t = b->pairs[i] >> 32;
+        b->seen[t / 64] &= ~(1ull << (t % 64));
+    }
+
+    return ret;
+}
+
+/* Carry file "id" of the index "old" (which is being updated, and must
+ * stay open until the new index is written) over to the new index
+ * unchanged, without reading it again */
+int index_builder_reuse (struct index_builder* b, struct index* old, uint32_t id)
+{
+    const struct index_file* from = &old->files[id];
+    struct index_file* file;
+    struct stat st;
+
+    if (b->old != old) {
+        free(b->remap);
+        b->old = old;
+        b->remap = calloc(old->hdr->num_files, sizeof(*b->remap));
+        if (!b->remap)
+            return -1;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.st_ino = from->ino;
+    st.st_mtim.tv_sec = from->mtime_ns / 1000000000;
+    st.st_mtim.tv_nsec = from->mtime_ns % 1000000000;
+    st.st_size = from->size;
+
+    file = add_file(b, index_file_name(old, id), &st);
+    if (!file)
+        return -1;
+    file->flags = from->flags;
+    b->remap[id] = b->num_files;
+
+    return 0;
+}
+
+/* Add the postings of the reused files, under their new ids */
+static int add_reused_pairs (struct index_builder* b)
+{
+    const struct index_header* hdr = b->old->hdr;
+    const struct index_trigram* t;
+    const uint32_t* post;
+    size_t i, j, num_postings;
+    uint32_t id;
+
+    num_postings = (hdr->names_off - hdr->postings_off) / sizeof(uint32_t);
+    for (i = 0; i < hdr->num_trigrams; i++) {
+        t = &b->old->trigrams[i];
+        if (t->off + t->count > num_postings)
+            continue;
+
+        post = b->old->postings + t->off;
+        for (j = 0; j < t->count; j++) {
+            if (post[j] >= hdr->num_files || !(id = b->remap[post[j]]))
+                continue;
+            if (b->num_pairs == b->max_pairs
+                    && grow((void**)&b->pairs, &b->max_pairs, b->num_pairs + 1,
+                            sizeof(*b->pairs)) < 0)
+                return -1;
+            b->pairs[b->num_pairs++] = (uint64_t)t->trigram << 32 | (id - 1);
+        }
+    }
+    b->unordered = 1;
+
+    return 0;
+}
+
+/* Stable sort of the pairs by trigram with 8-bit radix passes, which
+ * keeps every posting list in ascending file id order.  If the pairs
+ * weren't added in file id order, they are sorted by id first. */
+static int sort_pairs (struct index_builder* b)
+{
+    size_t count[256], i, pos, sum;
+    uint64_t* tmp;
+    uint64_t* swap;
+    unsigned int shift;
+
+    tmp = malloc(b->num_pairs * sizeof(*tmp) + 1);
+    if (!tmp)
+        return -1;
+
+    /* ids take as many bytes as the number of files; trigram keys are
+     * 25 bits wide (TRIGRAM_UNINDEXED included) */
+    for (shift = 0; shift < 64; shift += 8) {
+        if (shift < 32 && (!b->unordered || b->num_files >> shift == 0))
+            shift = 32;
+
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < b->num_pairs; i++)
+            count[(b->pairs[i] >> shift) & 0xff]++;
+
+        for (i = 0, sum = 0; i < 256; i++) {
+            pos = count[i];
+            count[i] = sum;
+            sum += pos;
+        }
+
+        for (i = 0; i < b->num_pairs; i++)
+            tmp[count[(b->pairs[i] >> shift) & 0xff]++] = b->pairs[i];
+
+        swap = b->pairs;
+        b->pairs = tmp;
+        tmp = swap;
+    }
+    free(tmp);
+
+    return 0;
+}
+
+static int write_all (FILE* fp, const void* data, size_t len)
+{
+    return fwrite(data, 1, len, fp) == len ? 0 : -1;
+}
+
+/* Write the index out to "file".  It goes to a temporary file next to
+ * it first, which is then renamed over "file". */
+int index_builder_write (struct index_builder* b, const char* file)
+{
+    struct index_header hdr;
+    struct index_trigram* trigrams = NULL;
+    size_t num_trigrams = 0, max_trigrams = 0;
+    uint32_t t, id;
+    char* tmp;
+    FILE* fp = NULL;
+    size_t i;
+    int fd, ret = -1;
+
+    if (b->old && add_reused_pairs(b) < 0)
+        return -1;
+    if (sort_pairs(b) < 0)
+        return -1;
+
+    for (i = 0; i < b->num_pairs; i++) {
+        t = b->pairs[i] >> 32;
+        if (num_trigrams && trigrams[num_trigrams - 1].trigram == t) {
+            trigrams[num_trigrams - 1].count++;
+            continue;
+        }
+        if (grow((void**)&trigrams, &max_trigrams, num_trigrams + 1,
+                 sizeof(*trigrams)) < 0)
+            goto out;
+        trigrams[num_trigrams].trigram = t;
+        trigrams[num_trigrams].count = 1;
+        trigrams[num_trigrams].off = i;
+        num_trigrams++;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = INDEX_VERSION;
+    hdr.num_files = b->num_files;
+    hdr.num_trigrams = num_trigrams;
+    hdr.files_off = sizeof(hdr);
+    hdr.trigrams_off = hdr.files_off + b->num_files * sizeof(struct index_file);
+    hdr.postings_off = hdr.trigrams_off + num_trigrams * sizeof(struct index_trigram);
+    hdr.names_off = hdr.postings_off + b->num_pairs * sizeof(uint32_t);
+    hdr.size = hdr.names_off + b->names_len;
+
+    if (asprintf(&tmp, "%s.XXXXXX", file) < 0)
+        goto out;
+    fd = mkstemp(tmp);
+    if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        goto out;
+    }
+    fchmod(fd, 0644);
+
+    ret = write_all(fp, &hdr, sizeof(hdr));
+    if (!ret)
+        ret = write_all(fp, b->files, b->num_files * sizeof(*b->files));
+    if (!ret)
+        ret = write_all(fp, trigrams, num_trigrams * sizeof(*trigrams));
+    for (i = 0; !ret && i < b->num_pairs; i++) {
+        id = b->pairs[i];
+        ret = write_all(fp, &id, sizeof(id));
+    }
+    if (!ret)
+        ret = write_all(fp, b->names, b->names_len);
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+        ret = -1;
+    if (fclose(fp) != 0)
+        ret = -1;
+    if (!ret && rename(tmp, file) < 0)
+        ret = -1;
+    if (ret)
+        unlink(tmp);
+    free(tmp);
+
+out:
+    free(trigrams);
+    return ret;
+}
+
+void index_builder_free (struct index_builder* b)
+{
+    if (!b)
+        return;
+
+    free(b->files);
+    free(b->names);
+    free(b->pairs);
+    free(b->seen);
+    free(b->remap);
+    free(b);
+}
+
+
+/***** SEARCHING *************************************/
+static size_t hash_name (const char* name)
+{
+    size_t h = 14695981039346656037ull;
+
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 1099511628211ull;
+
+    return h;
+}
+
+/* Build the hash table of all the names that index_find looks in */
+static int build_table (struct index* idx)
+{
+    size_t size, i;
+    uint32_t id;
+
+    for (size = 16; size < 2 * (size_t)idx->hdr->num_files; size *= 2)
+        ;
+    idx->table = calloc(size, sizeof(*idx->table));
+    if (!idx->table)
+        return -1;
+    idx->table_mask = size - 1;
+
+    for (id = 0; id < idx->hdr->num_files; id++) {
+        i = hash_name(index_file_name(idx, id)) & idx->table_mask;
+        while (idx->table[i])
+            i = (i + 1) & idx->table_mask;
+        idx->table[i] = id + 1;
+    }
+
+    return 0;
+}
+
+/* Map the index "file" and check that it is one of ours and intact */
+struct index* index_open (const char* file)
+{
+    const struct index_header* hdr;
+    struct index* idx;
+    struct stat st;
+    void* map;
+    int fd;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    hdr = map;
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic))
+            || hdr->version != INDEX_VERSION
+            || hdr->size != (uint64_t)st.st_size
+            || hdr->files_off != sizeof(*hdr)
+            || hdr->trigrams_off != hdr->files_off + (uint64_t)hdr->num_files
+                                                     * sizeof(struct index_file)
+            || hdr->postings_off != hdr->trigrams_off + (uint64_t)hdr->num_trigrams
+                                                        * sizeof(struct index_trigram)
+            || hdr->names_off < hdr->postings_off || hdr->names_off >= hdr->size
+            || ((const char*)map)[hdr->size - 1] != '\0') {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    idx = malloc(sizeof(*idx));
+    if (!idx) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    idx->map = map;
+    idx->size = st.st_size;
+    idx->hdr = hdr;
+    idx->files = (const struct index_file*)(idx->map + hdr->files_off);
+    idx->trigrams = (const struct index_trigram*)(idx->map + hdr->trigrams_off);
+    idx->postings = (const uint32_t*)(idx->map + hdr->postings_off);
+    idx->names = idx->map + hdr->names_off;
+    if (build_table(idx) < 0) {
+        munmap(map, st.st_size);
+        free(idx);
+        return NULL;
+    }
+
+    return idx;
+}
+
+void index_close (struct index* idx)
+{
+    if (!idx)
+        return;
+
+    munmap(idx->map, idx->size);
+    free(idx->table);
+    free(idx);
+}
+
+/* the canonical path of the tree the index was built for */
+const char* index_root (struct index* idx)
+{
+    return idx->names;
+}
+
+/* the name of file "id", relative to the root */
+const char* index_file_name (struct index* idx, uint32_t id)
+{
+    uint64_t off = idx->files[id].name_off;
+
+    if (off >= idx->hdr->size - idx->hdr->names_off)
+        return "";
+
+    return idx->names + off;
+}
+
+/* Look up the file called "name" (relative to the root).  Returns its
+ * id, or -1 if the index has no such file.  Only reads the index, so
+ * several threads can look up at once. */
+long index_find (struct index* idx, const char* name)
+{
+    size_t i;
+
+    for (i = hash_name(name) & idx->table_mask; idx->table[i];
+            i = (i + 1) & idx->table_mask)
+        if (!strcmp(index_file_name(idx, idx->table[i] - 1), name))
+            return idx->table[i] - 1;
+
+    return -1;
+}
+
+/* is file "id" still the file described by "st"? */
+int index_file_unchanged (struct index* idx, uint32_t id, const struct stat* st)
+{
+    const struct index_file* file = &idx->files[id];
+
+    return file->ino == (uint64_t)st->st_ino && file->mtime_ns == mtime_ns(st)
+           && file->size == (uint64_t)st->st_size;
+}
+
+/* the posting list for "trigram", or NULL if no file has it */
+static const struct index_trigram* lookup (struct index* idx, uint32_t trigram)
+{
+    size_t lo = 0, hi = idx->hdr->num_trigrams, mid;
+    const struct index_trigram* t;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        t = &idx->trigrams[mid];
+        if (t->trigram == trigram)
+            return t->off + t->count <= (idx->hdr->names_off - idx->hdr->postings_off)
+                                        / sizeof(uint32_t) ? t : NULL;
+        if (t->trigram < trigram)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+static int by_count (const void* a, const void* b)
+{
+    const struct index_trigram* x = *(const struct index_trigram* const*)a;
+    const struct index_trigram* y = *(const struct index_trigram* const*)b;
+
+    return x->count < y->count ? -1 : x->count > y->count;
+}
+
+/* Find the files that may contain string[0..len): the intersection of
+ * the posting lists of its trigrams, plus the unindexed files.  The ids
+ * are returned in ascending (traversal) order in a malloc'd *ids.
+ * Returns how many there are, or -1 if the index can't narrow the
+ * search down (the string is too short, or we ran out of memory) and
+ * the whole tree must be searched. */
+long index_candidates (struct index* idx, const char* string, size_t len, uint32_t** ids)
+{
+    const unsigned char* p = (const unsigned char*)string;
+    const struct index_trigram** lists;
+    const struct index_trigram* unindexed;
+    uint32_t* result = NULL;
+    uint32_t* merged;
+    const uint32_t* post;
+    size_t num_lists = 0, num = 0, i, j, k, m, n;
+    uint32_t t;
+
+    if (len < 3)
+        return -1;
+
+    lists = malloc((len - 2) * sizeof(*lists));
+    if (!lists)
+        return -1;
+
+    t = fold(p[0]) << 8 | fold(p[1]);
+    for (i = 2; i < len; i++) {
+        t = (t << 8 | fold(p[i])) & (TRIGRAM_SPACE - 1);
+        lists[num_lists] = lookup(idx, t);
+        if (!lists[num_lists]) {
+            num_lists = 0;
+            break;
+        }
+        num_lists++;
+    }
+
+    /* intersect, smallest list first */
+    if (num_lists) {
+        qsort(lists, num_lists, sizeof(*lists), by_count);
+        result = malloc(lists[0]->count * sizeof(*result));
+        if (!result)
+            goto fail;
+        memcpy(result, idx->postings + lists[0]->off, lists[0]->count * sizeof(*result));
+        num = lists[0]->count;
+
+        for (i = 1; i < num_lists && num; i++) {
+            if (lists[i] == lists[i - 1])
+                continue;
+            post = idx->postings + lists[i]->off;
+            n = lists[i]->count;
+            for (j = 0, k = 0, m = 0; j < num && k < n; ) {
+                if (result[j] < post[k])
+                    j++;
+                else if (result[j] > post[k])
+                    k++;
+                else {
+                    result[m++] = result[j];
+                    j++;
+                    k++;
+                }
+            }
+            num = m;
+        }
+    }
+
+    /* merge in the files whose contents the index knows nothing about */
+    unindexed = lookup(idx, TRIGRAM_UNINDEXED);
+    if (unindexed) {
+        post = idx->postings + unindexed->off;
+        n = unindexed->count;
+        merged = malloc((num + n) * sizeof(*merged) + 1);
+        if (!merged)
+            goto fail;
+        for (i = 0, j = 0, k = 0; j < num || k < n; ) {
+            if (k == n || (j < num && result[j] < post[k]))
+                merged[i++] = result[j++];
+            else
+                merged[i++] = post[k++];
+        }
+        free(result);
+        result = merged;
+        num = i;
+    }
+
+    /* drop ids that aren't in the file table */
+    for (i = 0, j = 0; i < num; i++)
+        if (result[i] < idx->hdr->num_files)
+            result[j++] = result[i];
+    num = j;
+
+    free(lists);
+    *ids = result;
+
+    return num;
+
+fail:
+    free(result);
+    free(lists);
+    return -1;
+}
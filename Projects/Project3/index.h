@@ -0,0 +1,70 @@
+#ifndef _index_h_
+#define _index_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* On-disk layout.  Everything is naturally aligned so the index can be
+ * used straight out of an mmap:
+ *
+ *   struct index_header
+ *   struct index_file     files[num_files]        (traversal order)
+ *   struct index_trigram  trigrams[num_trigrams]  (sorted by trigram)
+ *   uint32_t              postings[]              (file ids, ascending)
+ *   char                  names[]                 (root, then paths
+ *                                                  relative to it)
+ */
+#define INDEX_MAGIC "MGREPIDX"
+#define INDEX_VERSION 1
+
+/* file flags */
+#define INDEX_FILE_UNINDEXED 0x1    /* binary or huge: always a candidate */
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_files;
+    uint32_t num_trigrams;
+    uint32_t reserved;
+    uint64_t files_off;
+    uint64_t trigrams_off;
+    uint64_t postings_off;
+    uint64_t names_off;
+    uint64_t size;
+};
+
+struct index_file {
+    uint64_t name_off;          /* into names[] */
+    uint64_t ino;
+    int64_t mtime_ns;
+    uint64_t size;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct index_trigram {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t off;               /* first entry in postings[] */
+};
+
+struct index_builder;
+struct index;
+
+struct index_builder* index_builder_new (const char* root);
+int index_builder_add (struct index_builder* b, const char* name, const struct stat* st,
+                       const char* buf, size_t len, int unindexed);
+int index_builder_reuse (struct index_builder* b, struct index* old, uint32_t id);
+int index_builder_write (struct index_builder* b, const char* file);
+void index_builder_free (struct index_builder* b);
+
+struct index* index_open (const char* file);
+void index_close (struct index* idx);
+const char* index_root (struct index* idx);
+const char* index_file_name (struct index* idx, uint32_t id);
+long index_find (struct index* idx, const char* name);
+int index_file_unchanged (struct index* idx, uint32_t id, const struct stat* st);
+long index_candidates (struct index* idx, const char* string, size_t len, uint32_t** ids);
+
+#endif /* _index_h_ */
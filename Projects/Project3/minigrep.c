@@ -6,347 +6,3298 @@
  *  Updated: 03/17/2019
  *
  * Compile with:
- *   $ gcc -o minigrep minigrep.c -pthread
+ *   $ make
  *
- * NOTE: the search algorithm is generally slower with the multithreaded
- *       option due to the serial nature of the process of checking lines.
- *       Each directory and/or file is linearly enqueued and dequeued one
- *       after the other, so utilizing multiple threads does not accelerate
- *       the process since all other threads have to wait for one thread to
- *       finish going through a file or directory before any other thread
- *       can run. Adding more threads increases the probability that the
- *       CPU scheduler will run the code more often, however, the overhead
- *       from creating multiple threads negates that effect. This was the
- *       conclusion after running multiple tests and comparing the timing
- *       results with that of the single threaded option.
+ * NOTE: the multithreaded option runs a persistent pool of worker threads
+ *       (one per online core by default).  Each worker owns a lock-free
+ *       work queue: it posts the contents of the directories it visits to
+ *       its own queue and takes work from it first, while idle workers
+ *       steal from the other workers' queues.  Owners and thieves alike
+ *       take the oldest item (the queues are FIFO, so the traversal stays
+ *       breadth first, as with -S), except for the items --queue-memory
+ *       pushes to the front.  Files are scanned without
+ *       holding any shared lock, so independent files and directories are
+ *       processed concurrently.
  **********************************************/
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <dirent.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <getopt.h>
+
+#include "queue.h"
+#include "path.h"
+#include "uring.h"
+#include "output.h"
+#include "search.h"
+#include "index.h"
+#include "filter.h"
+#include "stats.h"
+#include "slab.h"
+#include "ac.h"
+#include "rx.h"
+#include "fuzzy.h"
 
 /***** HELPER FUCTIONS: WORK QUEUE *******************/
-#define QUEUE_INITIALIZER NULL
-#define NUM_WORKER_THREADS 10
+/* ring slots in each work queue; anything beyond this spills onto a
+ * locked list until the ring drains (must be a power of 2) */
+#define QUEUE_CAPACITY 4096
+
+/* number of pool threads; 0 sizes the pool to the number of online cores */
+#ifndef NUM_WORKER_THREADS
+#define NUM_WORKER_THREADS 0
+#endif
+
+/***** FILE SCANNING *********************************/
+/* block size used when a file can't be mapped and must be read */
+#define SCAN_BLOCK_SIZE (1 << 20)
+
+/* while the search may be cancelled (-q, --max-count), buffers are
+ * searched this much at a time so that a cancellation is noticed in
+ * the middle of a big file */
+#define CANCEL_SLICE (1 << 20)
+
+/* an -E match with no limit on its length is taken to be no longer than
+ * this where a binary file is searched in overlapping pieces */
+#define REGEX_MAX_SPAN 4096
+
+/* -E lines are only picked out with the substring search if every match
+ * contains a literal at least this long */
+#define REGEX_MIN_LITERAL 2
+
+/* --fuzzy lines are only picked out by the pieces of the string that
+ * every match holds one of if the pieces are at least this long... */
+#define FUZZY_MIN_PIECE 2
+
+/* ...in windows of this many bytes to start with, doubled every time
+ * none of the pieces turns up */
+#define FUZZY_WINDOW 16384
+
+/* how much of the start of a file is examined to decide if it is binary */
+#define BINARY_PROBE_SIZE 8192
+
+/* without --sorted, a file's output is written out early once this much
+ * of it has piled up, rather than holding it all until the file is done
+ * (stdout stays locked until it is, see outbuf_flush_early) */
+#define OUTBUF_FLUSH_SIZE (1 << 20)
+
+/* with more than one worker, text files of at least two chunks are
+ * split into chunks of this size (cut at line boundaries) that are
+ * scanned by different workers */
+#define SPLIT_CHUNK_SIZE (8 << 20)
+
+/* work item type of one chunk of a split file (not a DT_* value) */
+#define WORK_CHUNK 0xff
+
+/* work item type of a directory listing to be carried on with */
+#define WORK_CURSOR 0xfe
+
+/* buffer handed to each getdents64 call */
+#define DIRENT_BUF_SIZE (32 * 1024)
+
+/***** io_uring ENGINE ********************************/
+/* file opens/reads each -U worker keeps in flight */
+#define URING_DEPTH 64
+
+/* files up to this size are read whole through the ring; anything
+ * bigger is mapped and scanned in place instead */
+#define URING_MAX_READ (4 << 20)
+
+/* read buffers up to this size are kept for the next files rather than
+ * freed; smaller ones are allocated at least URING_MIN_BUF bytes so one
+ * buffer does for most files */
+#define URING_KEEP_SIZE (256 << 10)
+#define URING_MIN_BUF (16 << 10)
+
+/***** TRIGRAM INDEX *********************************/
+/* files bigger than this aren't indexed; they are searched every time */
+#define INDEX_MAX_FILE_SIZE (64 << 20)
+
+/***** COMMAND LINE OPTIONS **************************/
+enum {
+    OPT_SORTED = 256,
+    OPT_BINARY_FILES,
+    OPT_BUILD_INDEX,
+    OPT_UPDATE_INDEX,
+    OPT_INDEX,
+    OPT_INCLUDE,
+    OPT_EXCLUDE,
+    OPT_EXCLUDE_DIR,
+    OPT_GITIGNORE,
+    OPT_FILE_TIMES,
+    OPT_STATS,
+    OPT_QUEUE_MEMORY,
+    OPT_MAX_COUNT,
+    OPT_FUZZY
+};
+
+/* what to do with files that look binary (--binary-files) */
+enum binary_mode {
+    BINARY_REPORT,              /* print "Binary file ... matches" once */
+    BINARY_SKIP,                /* don't search them at all */
+    BINARY_TEXT                 /* search them like any other file */
+};
+
+/* what is printed for the matches */
+enum output_mode {
+    OUTPUT_LINES,               /* every matching line (the default) */
+    OUTPUT_FILES,               /* -l: the names of matching files */
+    OUTPUT_COUNT,               /* -c: matching lines per file */
+    OUTPUT_QUIET                /* -q: nothing; the exit status says */
+};
+
+struct options {
+    int sorted;                 /* --sorted: -P/-U output in -S order */
+    enum output_mode output;
+    enum binary_mode binary_files;
+    char* build_index;          /* --build-index: write an index here */
+    int update_index;           /* --update-index: ... by updating it */
+    char* index;                /* --index: search through this index */
+    int file_times;             /* --file-times: time every file */
+    int stats;                  /* --stats: report where the time went */
+    size_t queue_memory;        /* --queue-memory: pending work budget */
+    unsigned long max_count;    /* --max-count: stop after this many */
+    int regex;                  /* -E: the patterns are regular expressions */
+    int icase;                  /* -i: ignore case */
+    int words;                  /* -w: only matches that are whole words */
+    unsigned int fuzzy;         /* --fuzzy: edits a match may take */
+    unsigned int before;        /* -B: context lines before a match */
+    unsigned int after;         /* -A: ... and after it */
+    int context;                /* any of -A/-B/-C (even 0): "--" too */
+};
 
 /***** CUSTOM TYPES **********************************/
-struct queue {
-    char path[PATH_MAX];
-    struct queue *next;
+typedef struct stopwatch {
+    uint64_t start;
+} stopwatch_t;
+
+/* how long each file took to search, in microseconds (--file-times) */
+struct file_times {
+    uint32_t* us;
+    size_t num;
+    size_t max;
+};
+
+/* state private to each searching thread */
+struct thread_ctx {
+    unsigned int num_occurences;
+    uint64_t bytes_scanned;
+    struct outbuf out;          /* output of the file being scanned */
+    char* block_buf;            /* scan_fd_blocks' buffer, kept across files */
+    size_t block_size;
+    struct slab_cache slab;
+    struct ac_tally tally;      /* lines per pattern, with -e/-f */
+    struct rx_dfa* dfa;         /* -E: this thread's DFA, made on first use */
+    int split_files;            /* share big files out in chunks? */
+    struct file_times times;
+    struct stats stats;
+};
+
+/* a matching line found in a chunk, numbered within the chunk */
+struct chunk_hit {
+    unsigned int line;
+    const char* start;
+    size_t len;
+};
+
+/* A big file whose chunks are being scanned by several workers.  The
+ * worker finishing the last chunk works out each chunk's first line
+ * number from the newline counts of the chunks before it and prints
+ * all the hits in file order. */
+struct split_file {
+    char* map;
+    size_t size;
+    char* path;
+    struct seq_node* seq;       /* the file's place in the output order */
+    atomic_size_t remaining;    /* chunks not yet scanned */
+    size_t num_chunks;
+    struct chunk* chunks;
+};
+
+/* The lines starting in [start, end) of a split file */
+struct chunk {
+    struct split_file* file;
+    size_t start;
+    size_t end;
+    unsigned int newlines;      /* in those lines */
+    struct chunk_hit* hits;     /* not kept with -c, just counted */
+    size_t num_hits;
+    size_t max_hits;
+};
+
+/* per-file state threaded through the buffer scanner */
+struct scan_state {
+    struct work_item* item;
+    struct outbuf* out;
+    char* path;                 /* built on the first match */
+    const char* string;
+    size_t string_len;          /* or the longest pattern's */
+    search_fn_t find;           /* the kernel that looks for it */
+    int words;                  /* -w on the string */
+    const struct ac* ac;        /* several patterns: search for them all */
+    struct ac_tally* tally;
+    struct rx_dfa* dfa;         /* -E */
+    const struct fuzzy* fuzzy;  /* --fuzzy */
+    const char* pieces;         /* --fuzzy: one is in every match */
+    size_t num_pieces;
+    const char* literal;        /* -E: in every match, if not NULL */
+    size_t literal_len;
+    int line_numbers;           /* are line numbers needed at all? */
+    unsigned int line_number;   /* newlines seen before the scan point */
+    unsigned int last_printed;  /* -A/-B: number of the last line printed */
+    unsigned int after_left;    /* after context still to print */
+    size_t history;             /* bytes before the buffer kept for -B */
+    unsigned int matches;
+    int binary;                 /* file looked binary */
+    int done;                   /* nothing more to learn from this file */
+    struct chunk* chunk;        /* record hits here instead of printing */
+    uint64_t bytes;             /* handed to scan_buffer so far */
+};
+
+/* called by handle_directory for every entry it finds */
+typedef void (*post_work_t)(void* ctx, struct work_item* item);
+
+struct worker {
+    pthread_t tid;
+    unsigned int id;
+    unsigned int rand_state;
+    struct thread_ctx ctx;
+    struct pool* pool;
+    queue_t queue;
+
+    /* -U only: this worker's ring and the files it has in flight */
+    struct uring* ring;
+    unsigned int depth;
+    unsigned int inflight;
+    struct file_op* ops[URING_DEPTH];       /* the first "inflight" of them */
+    char* spare_bufs[URING_DEPTH];  /* read buffers of files that are done */
+    size_t spare_sizes[URING_DEPTH];
+    unsigned int num_spare;
+};
+
+/* a file making its way through a worker's io_uring: first the open is
+ * in flight (fd < 0), then one or more reads into buf */
+struct file_op {
+    struct work_item* item;
+    const char* name;           /* as resolved for openat */
+    uint64_t start;             /* when it was submitted (--file-times) */
+    int fd;
+    char* buf;
+    size_t buf_size;
+    size_t size;
+    size_t len;
+    unsigned int slot;          /* in the worker's ops[] */
+};
+
+struct pool {
+    struct worker* workers;
+    unsigned int num_workers;
+
+    /* items posted but not yet fully processed; the search is over
+     * once this drops to zero */
+    atomic_size_t pending;
+    /* items sitting in some worker's queue waiting to be picked up */
+    atomic_size_t queued;
+
+    /* idle workers sleep here until new work is posted */
+    atomic_uint num_idle;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_signal;
+};
+/***************************/
+
+/***** GLOBAL VARIABLES ******************************/
+static unsigned int num_occurences = 0;
+static uint64_t bytes_scanned = 0;
+static struct file_times file_times;
+static struct stats stats_total;
+static atomic_size_t queued_bytes;
+static atomic_int search_cancelled;     /* nothing more to find: stop */
+static atomic_ulong matches_claimed;    /* --max-count */
+static struct options opt;
+
+/* -e and -f; two or more of them are searched for with "patterns_ac" */
+static char** patterns;
+static size_t num_patterns;
+static size_t max_patterns;
+static struct ac* patterns_ac;
+static unsigned long* pattern_lines;    /* lines each one was found on */
+static struct rx* pattern_rx;           /* -E */
+static const char* regex_literal;       /* ... and what its matches contain */
+static size_t regex_literal_len;
+static char* search_string;             /* what to look for, if not the string */
+static struct fuzzy* pattern_fuzzy;     /* --fuzzy */
+static char* fuzzy_string;              /* ... folded with -i, and the */
+static size_t fuzzy_bounds[FUZZY_MAX_LEN + 1];  /* pieces it is cut into */
+static size_t num_fuzzy_pieces;         /* (0: too short to be worth it) */
+
+/* --index */
+static struct index* search_index;
+static uint32_t* index_ids;             /* candidates, in file id order */
+static long index_num_ids;
+static size_t index_root_len;           /* of the path it is searched as */
+static struct stat index_self;          /* which isn't in it */
+static atomic_ulong index_stale;        /* files added or changed since */
+
+char* string;
+
+/***************************/
+
+/***** HELPER FUCTIONS: CODE TIMING ******************/
+void stopwatch_start (stopwatch_t* sw)
+{
+    sw->start = monotonic_ns();
+}
+
+float stopwatch_report (stopwatch_t* sw)
+{
+    return (monotonic_ns() - sw->start) / 1e9;
+}
+/***************************/
+
+
+/***** HELPER FUCTIONS: FILE TIMES *******************/
+/* record that a file took "ns" nanoseconds */
+static void file_times_add (struct file_times* ft, uint64_t ns)
+{
+    uint32_t* us;
+    size_t max;
+
+    if (ft->num == ft->max) {
+        max = ft->max ? 2 * ft->max : 1024;
+        us = realloc(ft->us, max * sizeof(*us));
+        if (!us)
+            return;
+        ft->us = us;
+        ft->max = max;
+    }
+
+    ft->us[ft->num++] = ns / 1000 > UINT32_MAX ? UINT32_MAX : ns / 1000;
+}
+
+/* fold a finished thread's figures into the totals */
+static void thread_ctx_merge (struct thread_ctx* tc)
+{
+    uint32_t* us;
+    size_t i;
+
+    num_occurences += tc->num_occurences;
+    bytes_scanned += tc->bytes_scanned;
+    stats_merge(&stats_total, &tc->stats);
+
+    if (tc->tally.lines) {
+        for (i = 0; i < num_patterns; i++)
+            pattern_lines[i] += tc->tally.lines[i];
+        ac_tally_free(&tc->tally);
+    }
+
+    if (tc->times.num) {
+        us = realloc(file_times.us, (file_times.num + tc->times.num) * sizeof(*us));
+        if (us) {
+            memcpy(us + file_times.num, tc->times.us, tc->times.num * sizeof(*us));
+            file_times.us = us;
+            file_times.num += tc->times.num;
+            file_times.max = file_times.num;
+        }
+    }
+    free(tc->times.us);
+    free(tc->block_buf);
+    tc->block_buf = NULL;
+    rx_dfa_free(tc->dfa);
+    tc->dfa = NULL;
+    outbuf_free(&tc->out);
+}
+
+static int cmp_uint32 (const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Print the --file-times summary to stderr as a single line of
+ * key=value pairs, for the benchmark driver to pick up */
+static void file_times_report (void)
+{
+    uint32_t p50 = 0, p99 = 0;
+
+    if (file_times.num) {
+        qsort(file_times.us, file_times.num, sizeof(*file_times.us), cmp_uint32);
+        p50 = file_times.us[(file_times.num - 1) / 2];
+        p99 = file_times.us[(file_times.num - 1) * 99 / 100];
+    }
+
+    fprintf(stderr, "file-times: files=%zu bytes=%llu p50_us=%u p99_us=%u\n",
+            file_times.num, (unsigned long long)bytes_scanned, p50, p99);
+}
+/***************************/
+
+
+/***** HELPER FUCTIONS: SUMMARY *********************/
+/* Print the closing line of a search (except with -q) and, with
+ * several patterns, how many lines each one was found on */
+static void print_summary (const char* string)
+{
+    size_t i;
+
+    if (opt.output == OUTPUT_QUIET)
+        return;
+
+    if (patterns_ac) {
+        if (opt.output == OUTPUT_FILES)
+            printf("\n\nFound %zu pattern(s) in %u file(s).\n", num_patterns,
+                   num_occurences);
+        else
+            printf("\n\nFound %u instance(s) of %zu pattern(s).\n", num_occurences,
+                   num_patterns);
+        if (opt.output == OUTPUT_LINES)
+            for (i = 0; i < num_patterns; i++)
+                printf("%10lu line(s): \"%s\"\n", pattern_lines[i], patterns[i]);
+        return;
+    }
+
+    if (!opt.regex && num_patterns > 1) {
+        if (opt.output == OUTPUT_FILES)
+            printf("\n\nFound %zu pattern(s) in %u file(s).\n", num_patterns,
+                   num_occurences);
+        else
+            printf("\n\nFound %u instance(s) of %zu pattern(s).\n", num_occurences,
+                   num_patterns);
+        return;
+    }
+    if (opt.regex && num_patterns > 1) {
+        if (opt.output == OUTPUT_FILES)
+            printf("\n\nFound %zu regex(es) in %u file(s).\n", num_patterns,
+                   num_occurences);
+        else
+            printf("\n\nFound %u instance(s) of %zu regex(es).\n", num_occurences,
+                   num_patterns);
+        return;
+    }
+    if (opt.regex) {
+        if (opt.output == OUTPUT_FILES)
+            printf("\n\nFound regex \"%s\" in %u file(s).\n", string, num_occurences);
+        else
+            printf("\n\nFound %u instance(s) of regex \"%s\".\n", num_occurences, string);
+        return;
+    }
+
+    if (opt.fuzzy) {
+        if (opt.output == OUTPUT_FILES)
+            printf("\n\nFound string \"%s\" (up to %u edit(s)) in %u file(s).\n", string,
+                   opt.fuzzy, num_occurences);
+        else
+            printf("\n\nFound %u instance(s) of string \"%s\" (up to %u edit(s)).\n",
+                   num_occurences, string, opt.fuzzy);
+        return;
+    }
+
+    if (opt.output == OUTPUT_FILES)
+        printf("\n\nFound string \"%s\" in %u file(s).\n", string, num_occurences);
+    else
+        printf("\n\nFound %u instance(s) of string \"%s\".\n", num_occurences, string);
+}
+
+/* The search's cancellation token, set once -q has seen a match or
+ * --max-count has been reached.  Workers poll it between work items and
+ * between slices of the buffer they are scanning. */
+static inline int cancelled (void)
+{
+    return atomic_load_explicit(&search_cancelled, memory_order_relaxed);
+}
+
+static inline int cancellable (void)
+{
+    return opt.max_count || opt.output == OUTPUT_QUIET;
+}
+
+/* With --max-count, claim one of the matches still to be had (the
+ * last one cancels the search).  Returns 0 if they are all gone, in
+ * which case the match is dropped.  Without --max-count the matches
+ * are counted per thread and this costs nothing. */
+static inline int claim_match (void)
+{
+    unsigned long n;
+
+    if (!opt.max_count)
+        return 1;
+
+    n = atomic_fetch_add(&matches_claimed, 1) + 1;
+    if (n >= opt.max_count)
+        atomic_store(&search_cancelled, 1);
+
+    return n <= opt.max_count;
+}
+/***************************/
+
+
+/***** HELPER FUCTIONS: PATTERNS ********************/
+/* Add the patterns in "arg" (-e), one per line like grep */
+static int add_patterns (const char* arg, size_t len)
+{
+    const char* nl;
+    char** tmp;
+    size_t max, n;
+
+    while (1) {
+        nl = memchr(arg, '\n', len);
+        n = nl ? (size_t)(nl - arg) : len;
+
+        if (num_patterns == max_patterns) {
+            max = max_patterns ? 2 * max_patterns : 16;
+            tmp = realloc(patterns, max * sizeof(*tmp));
+            if (!tmp)
+                return -1;
+            patterns = tmp;
+            max_patterns = max;
+        }
+        patterns[num_patterns] = strndup(arg, n);
+        if (!patterns[num_patterns])
+            return -1;
+        num_patterns++;
+
+        if (!nl)
+            return 0;
+        arg = nl + 1;
+        len -= n + 1;
+    }
+}
+
+/* Add the patterns listed in "file" (-f), one per line.  A blank line
+ * is an empty pattern, which matches every line. */
+static int add_pattern_file (const char* file)
+{
+    FILE* fp;
+    char* line = NULL;
+    size_t max = 0;
+    ssize_t len;
+    int ret = 0;
+
+    fp = strcmp(file, "-") ? fopen(file, "r") : stdin;
+    if (!fp)
+        return -1;
+
+    while (!ret && (len = getline(&line, &max, fp)) >= 0) {
+        if (len && line[len - 1] == '\n')
+            len--;
+        if (len && line[len - 1] == '\r')
+            len--;
+        ret = add_patterns(line, len);
+    }
+    if (ferror(fp))
+        ret = -1;
+
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+
+    return ret;
+}
+
+/* Does -i have to fold letters beyond ASCII, which the substring
+ * search and the automaton can't? */
+static int needs_utf8_case (const char* string)
+{
+    const unsigned char* p;
+    size_t i;
+
+    if (!opt.icase)
+        return 0;
+    if (!num_patterns)
+        for (p = (const unsigned char*)string; *p; p++)
+            if (*p >= 0x80)
+                return 1;
+    for (i = 0; i < num_patterns; i++)
+        for (p = (const unsigned char*)patterns[i]; *p; p++)
+            if (*p >= 0x80)
+                return 1;
+
+    return 0;
+}
+
+/* With -E, compile the pattern(s), or "string" if there are none: a
+ * regex that turns out to be a plain string is searched for as one.
+ * Plain strings go the same way when -i has to fold UTF-8 (the slow
+ * path).  --fuzzy takes the one string.  Otherwise a single pattern
+ * is searched for as the string, folded to lower case with -i, and two
+ * or more with the automaton that finds them all in one pass. */
+static int setup_patterns (char** string)
+{
+    const char* error;
+    const char* literal;
+    size_t len, i;
+    int exact, flags;
+
+    if (opt.fuzzy) {
+        if (opt.regex || opt.words || num_patterns > 1) {
+            fprintf(stderr, "error -- --fuzzy takes a single string, without -E or -w\n");
+            return -1;
+        }
+        len = strlen(*string);
+        if (len <= opt.fuzzy || len > FUZZY_MAX_LEN) {
+            fprintf(stderr, "error -- --fuzzy=%u needs a string of %u to %d bytes\n",
+                    opt.fuzzy, opt.fuzzy + 1, FUZZY_MAX_LEN);
+            return -1;
+        }
+        pattern_fuzzy = fuzzy_new(*string, len, opt.fuzzy, opt.icase ? FUZZY_ICASE : 0);
+        if (!pattern_fuzzy) {
+            fprintf(stderr, "error -- out of memory\n");
+            return -1;
+        }
+
+        /* K edits can't touch all of K + 1 pieces, so every match holds
+         * one of them unchanged */
+        fuzzy_string = strdup(*string);
+        if (!fuzzy_string) {
+            fprintf(stderr, "error -- out of memory\n");
+            return -1;
+        }
+        for (i = 0; opt.icase && i < len; i++)
+            if (fuzzy_string[i] - 'A' < 26u)
+                fuzzy_string[i] |= 0x20;
+        for (i = 0; i <= opt.fuzzy + 1; i++)
+            fuzzy_bounds[i] = i * len / (opt.fuzzy + 1);
+        if (len / (opt.fuzzy + 1) >= FUZZY_MIN_PIECE)
+            num_fuzzy_pieces = opt.fuzzy + 1;
+        return 0;
+    }
+
+    if (opt.regex || needs_utf8_case(*string)) {
+        if (!num_patterns && add_patterns(*string, strlen(*string)) < 0) {
+            fprintf(stderr, "error -- out of memory\n");
+            return -1;
+        }
+        *string = patterns[0];
+
+        flags = (opt.regex ? 0 : RX_LITERAL) | (opt.icase ? RX_ICASE : 0)
+              | (opt.words ? RX_WORDS : 0);
+        pattern_rx = rx_compile(patterns, num_patterns, flags, &error);
+        if (!pattern_rx) {
+            fprintf(stderr, "error -- invalid regular expression: %s\n", error);
+            return -1;
+        }
+
+        literal = rx_literal(pattern_rx, &len, &exact);
+        if (exact) {
+            search_string = strdup(literal);
+            rx_free(pattern_rx);
+            pattern_rx = NULL;
+            if (!search_string) {
+                fprintf(stderr, "error -- out of memory\n");
+                return -1;
+            }
+        }
+        else if (len >= REGEX_MIN_LITERAL) {
+            regex_literal = literal;
+            regex_literal_len = len;
+        }
+        return 0;
+    }
+
+    if (num_patterns < 2) {
+        if (opt.icase) {
+            search_string = strdup(*string);
+            if (!search_string) {
+                fprintf(stderr, "error -- out of memory\n");
+                return -1;
+            }
+            for (i = 0; search_string[i]; i++)
+                if (search_string[i] - 'A' < 26u)
+                    search_string[i] |= 0x20;
+        }
+        return 0;
+    }
+
+    patterns_ac = ac_build(patterns, num_patterns,
+                           (opt.icase ? AC_ICASE : 0) | (opt.words ? AC_WORDS : 0));
+    pattern_lines = calloc(num_patterns, sizeof(*pattern_lines));
+    if (!patterns_ac || !pattern_lines) {
+        fprintf(stderr, "error -- out of memory\n");
+        return -1;
+    }
+
+    return 0;
+}
+/***************************/
+
+
+/***** HELPER FUCTIONS: MEMORY BUDGET ***************/
+/* With --queue-memory, queued_bytes keeps track of the work items
+ * sitting in the queues.  Once it goes over the budget, new items are
+ * pushed to the front of the queues (so the traversal goes depth first
+ * and finishes subtrees rather than widening the frontier) and
+ * directories are listed a batch at a time. */
+static inline size_t work_item_size (const struct work_item* item)
+{
+    return sizeof(*item) + item->len + 1;
+}
+
+static inline void budget_queued (const struct work_item* item)
+{
+    if (opt.queue_memory)
+        atomic_fetch_add_explicit(&queued_bytes, work_item_size(item),
+                                  memory_order_relaxed);
+}
+
+static inline void budget_dequeued (const struct work_item* item)
+{
+    if (opt.queue_memory)
+        atomic_fetch_sub_explicit(&queued_bytes, work_item_size(item),
+                                  memory_order_relaxed);
+}
+
+static inline int over_budget (void)
+{
+    return opt.queue_memory
+           && atomic_load_explicit(&queued_bytes, memory_order_relaxed)
+              > opt.queue_memory;
+}
+
+/* Parse a size such as "512K", "64M" or "1G".  Returns -1 if it isn't
+ * one. */
+static int parse_size (const char* arg, size_t* size)
+{
+    unsigned long long n;
+    char* end;
+
+    errno = 0;
+    n = strtoull(arg, &end, 10);
+    if (errno || end == arg)
+        return -1;
+
+    switch (*end) {
+    case 'g': case 'G': n <<= 10; /* fall through */
+    case 'm': case 'M': n <<= 10; /* fall through */
+    case 'k': case 'K': n <<= 10; end++; break;
+    }
+    if (*end)
+        return -1;
+
+    *size = n;
+    return 0;
+}
+/***************************/
+
+
+/***** HELPER FUCTIONS: PRINT USAGE ******************/
+void print_usage (char* prog)
+{
+    printf("Usage: %s [options] mode path string \n", prog);
+    printf("       %s [options] mode path -e PATTERN... | -f FILE\n\n", prog);
+    printf("    mode    -   -S for single thread, -P for pthreads, or -U for\n");
+    printf("                   pthreads with file reads done through io_uring\n");
+    printf("    path    -   recursively scan all files in this path and report\n");
+    printf("                   all occurances of string\n");
+    printf("    string  -   scan files for this string\n\n");
+    printf("Options:\n");
+    printf("    -e PATTERN  -   search for PATTERN instead of string; give it\n");
+    printf("                       more than once to search for all of them in\n");
+    printf("                       a single pass and count the lines each one\n");
+    printf("                       is found on\n");
+    printf("    -f FILE     -   search for the patterns in FILE, one per line\n");
+    printf("    -E          -   string (or each pattern) is an extended regular\n");
+    printf("                       expression: . [] [^] ^ $ () | * + ? {m,n}\n");
+    printf("                       and \\d \\w \\s; a line matches if any of\n");
+    printf("                       it does\n");
+    printf("    -i          -   ignore case (beyond ASCII too, in UTF-8)\n");
+    printf("    -w          -   only match whole words: what matches must not\n");
+    printf("                       have a letter, digit or _ on either side\n");
+    printf("    --fuzzy=K   -   also match string with up to K characters\n");
+    printf("                       inserted, deleted or replaced; string can\n");
+    printf("                       be up to 64 bytes (-i folds ASCII only)\n");
+    printf("    -A NUM      -   print NUM lines of context after each match\n");
+    printf("    -B NUM      -   print NUM lines of context before each match\n");
+    printf("    -C NUM      -   same as -A NUM -B NUM; groups of lines that\n");
+    printf("                       aren't next to each other are set apart\n");
+    printf("                       by \"--\"\n");
+    printf("    --sorted    -   with -P or -U, print results in the same order\n");
+    printf("                       as -S would\n");
+    printf("    --binary-files=TYPE\n");
+    printf("                -   how to treat files that look binary: \"binary\"\n");
+    printf("                       (the default) reports only whether they match,\n");
+    printf("                       \"without-match\" skips them and \"text\"\n");
+    printf("                       searches them like text files\n");
+    printf("    -I          -   same as --binary-files=without-match\n");
+    printf("    -l          -   print only the names of files that match,\n");
+    printf("                       reading each only up to its first match\n");
+    printf("    -c          -   print only the number of matching lines of\n");
+    printf("                       each file that matches\n");
+    printf("    --max-count=N\n");
+    printf("                -   stop the whole search once N matches have\n");
+    printf("                       been found (with -l, N files)\n");
+    printf("    -q          -   print nothing and stop at the first match;\n");
+    printf("                       exit with status 0 if there was one, else 1\n");
+    printf("    --include=GLOB\n");
+    printf("                -   only search files whose name matches GLOB\n");
+    printf("    --exclude=GLOB\n");
+    printf("                -   skip files whose name matches GLOB\n");
+    printf("    --exclude-dir=GLOB\n");
+    printf("                -   skip directories whose name matches GLOB\n");
+    printf("    --gitignore -   skip .git and whatever .gitignore files ignore\n");
+    printf("    --file-times\n");
+    printf("                -   time the search of every file and print the\n");
+    printf("                       median and 99th percentile to stderr\n");
+    printf("    --queue-memory=SIZE\n");
+    printf("                -   keep the work waiting in the queues to about\n");
+    printf("                       SIZE bytes (K, M and G suffixes allowed) by\n");
+    printf("                       going depth first and listing directories\n");
+    printf("                       a batch at a time once it is exceeded\n");
+    printf("    --stats     -   print where the time went (per phase), files,\n");
+    printf("                       bytes, queue high-water mark and lock waits\n");
+    printf("                       to stderr\n");
+    printf("    --index=FILE\n");
+    printf("                -   only read the files that the trigram index\n");
+    printf("                       FILE says may contain string (or one of\n");
+    printf("                       the patterns), and any added or changed\n");
+    printf("                       since it was built\n\n");
+    printf("       %s --build-index=FILE path\n\n", prog);
+    printf("    build a trigram index of the files in path and write it to FILE\n\n");
+    printf("       %s --update-index=FILE path\n\n", prog);
+    printf("    bring the index in FILE up to date, reading only the files in\n");
+    printf("    path that were added or changed since it was written\n\n");
+}
+/***************************/
+
+
+
+
+/******************************************************************************
+ *********************  M I N I   G R E P   S T A R T *************************
+ ******************************************************************************/
+
+/* Print a warning about a work item, naming it by its full path */
+static void item_warning (FILE* stream, const char* msg, struct work_item* item)
+{
+    char* path = work_item_path(item);
+
+    fprintf(stream, "warning -- %s %s\n", msg, path ? path : item->name);
+    path_free(path);
+}
+
+/* likewise, adding the reason a system call gave for failing ("err",
+ * an errno value) */
+static void item_warning_errno (FILE* stream, const char* msg, struct work_item* item,
+                                int err)
+{
+    char* path = work_item_path(item);
+
+    fprintf(stream, "warning -- %s %s: %s\n", msg, path ? path : item->name,
+            strerror(err));
+    path_free(path);
+}
+
+/* Make a work item for "name" in directory "dir", remembering the file
+ * type the directory listing gave us so that nobody has to stat it
+ * later.  With --sorted, "seq" is the directory's place in the
+ * traversal order and the new item gets the next slot below it.
+ * Returns NULL for entries that aren't to be searched. */
+static struct work_item* new_entry (struct dir_ref* dir, struct seq_node* seq,
+                                    const char* name, unsigned char type)
+{
+    struct work_item* new_item;
+
+    /* Ignore "." (this directory) and ".." (parent directory) */
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+        return NULL;
+
+    /* prune filtered entries before they cost anything more; entries of
+     * unknown type are checked once handle_work_item has stat'ed them */
+    if (type != DT_UNKNOWN && filter_active() && filter_skip(dir, name, type))
+        return NULL;
+
+    new_item = work_item_new(dir, name, strlen(name), type);
+    if (!new_item) {
+        fprintf(stderr, "warning -- out of memory, skipping %s\n", name);
+        return NULL;
+    }
+    if (seq)
+        new_item->seq = seq_node_add_child(seq);
+
+    return new_item;
+}
+
+/* Post "name" in directory "dir" as a new work item */
+static void post_entry (struct dir_ref* dir, struct seq_node* seq, const char* name,
+                        unsigned char type, post_work_t post_work, void* ctx)
+{
+    struct work_item* new_item = new_entry(dir, seq, name, type);
+
+    if (new_item)
+        post_work(ctx, new_item);
+}
+
+#ifdef SYS_getdents64
+/* the record layout returned by getdents64(2); glibc doesn't export it */
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
 };
-typedef struct queue* queue_t;
 
-typedef struct stopwatch {
-    struct timeval start;
-} stopwatch_t;
+/* Post the entries of the open directory "ref" (read through "fd")
+ * that are still to be read, as children of "seq".  The directory is
+ * read with raw getdents64 calls into a large buffer, so a directory
+ * with thousands of entries costs a handful of system calls.
+ *
+ * Once the pending work is over the --queue-memory budget, a directory
+ * that stays open stops after the batch in hand: a WORK_CURSOR item
+ * that carries on from the directory's file offset is posted first and
+ * the batch after it, so that (depth first) the batch's entries are
+ * taken before the listing resumes.  Their seq slots are handed out
+ * before the cursor is posted, since it may be picked up at once by
+ * another worker.  Returns 1 if the listing was left to a cursor, 0 if
+ * it is complete and -1 on error. */
+static int list_directory (struct dir_ref* ref, int fd, struct seq_node* seq,
+                           post_work_t post_work, void* ctx)
+{
+    char buf[DIRENT_BUF_SIZE] __attribute__((aligned(8)));
+    struct linux_dirent64* entry;
+    struct work_item* batch;
+    struct work_item* cursor;
+    struct work_item* item;
+    long nread, pos;
+    uint64_t start;
+
+    /* scan through all files within the directory.  a return of 0
+     * means we have cycled through all items in the directory */
+    while (1) {
+        start = stats_start();
+        nread = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        stats_stop(start, PHASE_READDIR);
+        if (nread <= 0)
+            break;
+
+        if (ref->fd != fd || !over_budget()) {
+            for (pos = 0; pos < nread; pos += entry->d_reclen) {
+                entry = (struct linux_dirent64*)(buf + pos);
+                post_entry(ref, seq, entry->d_name, entry->d_type, post_work, ctx);
+            }
+            continue;
+        }
+
+        /* collected in reverse, so that posting them to the front of
+         * the queue leaves the first one on top */
+        batch = NULL;
+        for (pos = 0; pos < nread; pos += entry->d_reclen) {
+            entry = (struct linux_dirent64*)(buf + pos);
+            item = new_entry(ref, seq, entry->d_name, entry->d_type);
+            if (item) {
+                item->next = batch;
+                batch = item;
+            }
+        }
+
+        cursor = work_item_new(ref, "", 0, WORK_CURSOR);
+        if (cursor) {
+            cursor->seq = seq;
+            post_work(ctx, cursor);
+        }
+
+        while ((item = batch) != NULL) {
+            batch = item->next;
+            item->next = NULL;
+            post_work(ctx, item);
+        }
+
+        if (cursor)
+            return 1;
+    }
+
+    return nread < 0 ? -1 : 0;
+}
+
+/* Decend into the directory "dir" and post all the files and/or
+ * directories it contains as new work items, relative to the open
+ * directory */
+int handle_directory (struct work_item* dir, post_work_t post_work, void* ctx)
+{
+    struct dir_ref* ref;
+    uint64_t start;
+    int fd, ret;
+
+    start = stats_start();
+    fd = work_item_open(dir, O_RDONLY | O_DIRECTORY);
+    stats_stop(start, PHASE_OPEN);
+    if (fd < 0)
+        return -1;
+    stats_add(STAT_DIRS, 1);
+
+    ref = dir_ref_new(dir, fd);
+    if (!ref) {
+        close(fd);
+        return -1;
+    }
+    if (filter_gitignore())
+        ref->ignore = ignore_load(fd);
+
+    ret = list_directory(ref, fd, dir->seq, post_work, ctx);
+    /* the cursor completes the directory's place in the order */
+    if (ret > 0)
+        dir->seq = NULL;
+
+    if (ref->fd != fd)
+        close(fd);
+    dir_ref_put(ref);
+
+    return ret < 0 ? -1 : 0;
+}
+
+/* Carry on with the directory listing of the WORK_CURSOR item "cursor"
+ * (its parent is the directory itself) */
+static int handle_cursor (struct work_item* cursor, post_work_t post_work, void* ctx)
+{
+    int ret;
+
+    ret = list_directory(cursor->parent, cursor->parent->fd, cursor->seq, post_work, ctx);
+    if (ret > 0)
+        cursor->seq = NULL;
+
+    return ret < 0 ? -1 : 0;
+}
+#else
+/* Decend into the directory "dir" and post all the files and/or
+ * directories it contains as new work items */
+int handle_directory (struct work_item* dir, post_work_t post_work, void* ctx)
+{
+    DIR *ptr_dir = NULL;
+    struct dirent *ptr_result;
+    struct dir_ref* ref;
+    uint64_t start;
+    int fd;
+
+    start = stats_start();
+    fd = work_item_open(dir, O_RDONLY | O_DIRECTORY);
+    stats_stop(start, PHASE_OPEN);
+    if (fd < 0)
+        return -1;
+    stats_add(STAT_DIRS, 1);
+
+    ref = dir_ref_new(dir, fd);
+    if (!ref) {
+        close(fd);
+        return -1;
+    }
+    if (filter_gitignore())
+        ref->ignore = ignore_load(fd);
+
+    /* the stream gets its own descriptor since closedir closes it */
+    ptr_dir = fdopendir(dup(fd));
+    if (!ptr_dir) {
+        if (ref->fd != fd)
+            close(fd);
+        dir_ref_put(ref);
+        return -1;
+    }
+
+    /* scan through all files within the directory.  if ptr_result is
+     * NULL, we have cycled through all items in the directory */
+    while (1) {
+        start = stats_start();
+        ptr_result = readdir(ptr_dir);
+        stats_stop(start, PHASE_READDIR);
+        if (!ptr_result)
+            break;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+        post_entry(ref, dir->seq, ptr_result->d_name, ptr_result->d_type, post_work, ctx);
+#else
+        post_entry(ref, dir->seq, ptr_result->d_name, DT_UNKNOWN, post_work, ctx);
+#endif
+    }
+    closedir(ptr_dir);
+
+    if (ref->fd != fd)
+        close(fd);
+    dir_ref_put(ref);
+
+    return 0;
+}
+
+/* directories are always listed in one go here, so there are never
+ * any cursors */
+static int handle_cursor (struct work_item* cursor, post_work_t post_work, void* ctx)
+{
+    return 0;
+}
+#endif
+
+
+/* Guess whether buf[0..len) (the start of a file) is binary: it is if
+ * it has a NUL byte in it, or if more than 1 byte in 10 isn't part of a
+ * valid UTF-8 sequence */
+static int looks_binary (const char* buf, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    const unsigned char* end;
+    size_t i, n, invalid = 0;
+    unsigned char c;
+
+    if (len > BINARY_PROBE_SIZE)
+        len = BINARY_PROBE_SIZE;
+    end = p + len;
+
+    if (memchr(p, '\0', len))
+        return 1;
+
+    while (p < end) {
+        c = *p;
+        if (c < 0x80) {
+            p++;
+            continue;
+        }
+
+        /* expected length of the sequence led by c */
+        if (c >= 0xc2 && c <= 0xdf)
+            n = 2;
+        else if (c >= 0xe0 && c <= 0xef)
+            n = 3;
+        else if (c >= 0xf0 && c <= 0xf4)
+            n = 4;
+        else
+            n = 0;
+
+        for (i = 1; n && i < n; i++) {
+            /* a sequence cut off by the end of the probe gets the
+             * benefit of the doubt */
+            if (p + i == end)
+                break;
+            if ((p[i] & 0xc0) != 0x80)
+                n = 0;
+        }
+
+        if (!n) {
+            invalid++;
+            p++;
+        }
+        else
+            p += i;
+    }
+
+    return invalid * 10 > len;
+}
+
+/* Classify the file from its first block and decide, per
+ * --binary-files, whether it is worth scanning */
+static void scan_check_binary (struct scan_state* ss, const char* buf, size_t len)
+{
+    if (opt.binary_files == BINARY_TEXT || !looks_binary(buf, len))
+        return;
+
+    ss->binary = 1;
+    if (opt.binary_files == BINARY_SKIP)
+        ss->done = 1;
+}
+
+/* -E: the lines that hold the literal every match has to contain are
+ * picked out with the substring search, and only those are run through
+ * the DFA.  Without such a literal the DFA goes over the whole buffer. */
+static const char* scan_find_regex (const struct scan_state* ss, const char* buf,
+                                    size_t len)
+{
+    const char* end = buf + len;
+    const char* pos = buf;
+    const char* hit;
+    const char* line_start;
+    const char* line_end;
+    const char* match;
+
+    if (!ss->literal)
+        return rx_find(ss->dfa, buf, len);
+
+    while (pos < end) {
+        hit = ss->find(pos, end - pos, ss->literal, ss->literal_len);
+        if (!hit)
+            return NULL;
+
+        line_start = memrchr(pos, '\n', hit - pos);
+        line_start = line_start ? line_start + 1 : pos;
+        line_end = memchr(hit, '\n', end - hit);
+        if (!line_end)
+            line_end = end;
+
+        match = rx_find(ss->dfa, line_start, line_end - line_start);
+        if (match)
+            return match;
+        if (line_end == end)
+            break;
+        pos = line_end + 1;
+    }
+
+    return NULL;
+}
+
+/* --fuzzy: as with -E, the lines holding one of the pieces of the
+ * string that every match contains are picked out first, with a pass
+ * of the substring search per piece, and only those are searched in
+ * full.  The passes go a window at a time so that a piece that is rare
+ * isn't searched for to the end of the buffer for every line another
+ * one turns up on. */
+static const char* scan_find_fuzzy (const struct scan_state* ss, const char* buf,
+                                    size_t len)
+{
+    const char* end = buf + len;
+    const char* pos = buf;
+    const char* limit;
+    const char* hit;
+    const char* piece;
+    const char* line_start;
+    const char* line_end;
+    const char* match;
+    size_t window = FUZZY_WINDOW, piece_len, n, i;
+
+    if (!ss->num_pieces)
+        return fuzzy_find(ss->fuzzy, buf, len);
+
+    while (pos < end) {
+        /* the first piece that starts in [pos, limit) */
+        limit = end - pos > window ? pos + window : end;
+        hit = NULL;
+        for (i = 0; i < ss->num_pieces; i++) {
+            piece = ss->pieces + fuzzy_bounds[i];
+            piece_len = fuzzy_bounds[i + 1] - fuzzy_bounds[i];
+            if (hit)
+                limit = hit;
+            n = limit - pos + piece_len - 1;
+            if (n > (size_t)(end - pos))
+                n = end - pos;
+            match = ss->find(pos, n, piece, piece_len);
+            if (match)
+                hit = match;
+        }
+        if (!hit) {
+            pos = limit;
+            window *= 2;
+            continue;
+        }
+
+        /* pos may be in the middle of a line after a window with no
+         * hits */
+        line_start = memrchr(buf, '\n', hit - buf);
+        line_start = line_start ? line_start + 1 : buf;
+        line_end = memchr(hit, '\n', end - hit);
+        if (!line_end)
+            line_end = end;
+
+        match = fuzzy_find(ss->fuzzy, line_start, line_end - line_start);
+        if (match)
+            return match;
+        if (line_end == end)
+            break;
+        pos = line_end + 1;
+        window = FUZZY_WINDOW;
+    }
+
+    return NULL;
+}
+
+/* -w: only the string's hits are checked for word constituents on
+ * either side, so the search itself runs at full speed.  buf always
+ * ends at the end of a line (or of the file). */
+static const char* scan_find_word (const struct scan_state* ss, const char* buf,
+                                   size_t len)
+{
+    const char* end = buf + len;
+    const char* pos = buf;
+    const char* hit;
+
+    while (pos < end) {
+        hit = ss->find(pos, end - pos, ss->string, ss->string_len);
+        if (!hit)
+            return NULL;
+        if ((hit == buf || !search_is_word(hit[-1]))
+            && (hit + ss->string_len == end || !search_is_word(hit[ss->string_len])))
+            return hit;
+        pos = hit + 1;
+    }
+
+    return NULL;
+}
+
+/* The next match in buf[0..len): where the string starts, where the
+ * first of several patterns to be completed ends, where the regex
+ * matched or where a --fuzzy match ends.  Either way it lies on the
+ * matching line, which is all the callers need. */
+static inline const char* scan_find (const struct scan_state* ss, const char* buf,
+                                     size_t len)
+{
+    if (ss->ac)
+        return ac_find(ss->ac, buf, len);
+    if (ss->fuzzy)
+        return scan_find_fuzzy(ss, buf, len);
+    if (ss->dfa)
+        return scan_find_regex(ss, buf, len);
+    if (ss->words)
+        return scan_find_word(ss, buf, len);
+
+    return ss->find(buf, len, ss->string, ss->string_len);
+}
+
+/* A match when -l, -c or -q says only whether (or how often) the file
+ * matches counts, so no line is put together for it.  Returns 1 if
+ * there is no point looking any further. */
+static int scan_hit (struct scan_state* ss)
+{
+    if (!claim_match()) {
+        ss->done = 1;
+        return 1;
+    }
+    ss->matches++;
+
+    switch (opt.output) {
+    case OUTPUT_COUNT:
+        if (ss->chunk)
+            ss->chunk->num_hits++;
+        return 0;
+    case OUTPUT_QUIET:
+        atomic_store(&search_cancelled, 1);
+        break;
+    default:
+        break;
+    }
+
+    ss->done = 1;
+    return 1;
+}
+
+/* A binary file has no lines worth printing: all we want to know is
+ * whether the string is in there at all, and we can stop at the
+ * first hit.  (So with -c a binary file counts one match at most.) */
+static void scan_binary (struct scan_state* ss, const char* buf, size_t len)
+{
+    const char* end = buf + len;
+    const char* limit = end;
+    size_t overlap = ss->string_len ? ss->string_len - 1 : 0;
+
+    /* in slices that overlap by enough to catch a match across them */
+    while (1) {
+        if (cancellable() && end - buf > CANCEL_SLICE + overlap)
+            limit = buf + CANCEL_SLICE + overlap;
+        if (scan_find(ss, buf, limit - buf))
+            break;
+        if (limit == end)
+            return;
+        if (cancelled()) {
+            ss->done = 1;
+            return;
+        }
+        buf = limit - overlap;
+        limit = end;
+    }
+
+    ss->done = 1;
+    if (opt.output != OUTPUT_LINES) {
+        scan_hit(ss);
+        return;
+    }
+    if (!claim_match())
+        return;
+
+    if (!ss->path)
+        ss->path = work_item_path(ss->item);
+
+    outbuf_printf(ss->out, "Binary file %s matches\n",
+                  ss->path ? ss->path : ss->item->name);
+    ss->matches++;
+}
+
+/* Print line "number", [start, end), as a match (sep ':') or as
+ * context ('-') */
+static void print_line (struct scan_state* ss, unsigned int number, const char* start,
+                        const char* end, char sep)
+{
+    if (!ss->path)
+        ss->path = work_item_path(ss->item);
+
+    outbuf_printf(ss->out, "%s%c%u%c ", ss->path ? ss->path : ss->item->name, sep, number,
+                  sep);
+    outbuf_write(ss->out, start, end - start);
+    ss->last_printed = number;
+}
+
+/* -A: print the after context still owed from "p" on, stopping at
+ * "limit".  Returns where it stopped. */
+static const char* print_after (struct scan_state* ss, const char* p, const char* limit)
+{
+    const char* next;
+
+    while (ss->after_left && p < limit) {
+        next = memchr(p, '\n', limit - p);
+        next = next ? next + 1 : limit;
+        print_line(ss, ss->last_printed + 1, p, next, '-');
+        ss->after_left--;
+        p = next;
+    }
+
+    return p;
+}
+
+/* -B: print the lines before matching line "number", which starts at
+ * line_start, back to "floor" (the first byte still in memory) at the
+ * most.  They are found by stepping back over newlines from the match,
+ * so the lines between matches are never looked at.  A group that
+ * doesn't carry on from the last line printed gets a "--" first. */
+static void print_before (struct scan_state* ss, const char* floor,
+                          const char* line_start, unsigned int number)
+{
+    unsigned int want = opt.before, n;
+    const char* p = line_start;
+    const char* next;
+
+    /* not the lines printed already */
+    if (want > number - 1 - ss->last_printed)
+        want = number - 1 - ss->last_printed;
+    for (n = 0; n < want && p > floor; n++) {
+        next = memrchr(floor, '\n', p - 1 - floor);
+        p = next ? next + 1 : floor;
+    }
+
+    if (ss->last_printed && number - n > ss->last_printed + 1)
+        outbuf_write(ss->out, "--\n", 3);
+
+    for (; n; n--) {
+        next = (const char*)memchr(p, '\n', line_start - p) + 1;
+        print_line(ss, number - n, p, next, '-');
+        p = next;
+    }
+}
+
+/* Remember a matching line of a chunk until the line numbers are known */
+static void chunk_add_hit (struct chunk* c, unsigned int line, const char* start,
+                           size_t len)
+{
+    struct chunk_hit* hits;
+    size_t max;
+
+    if (c->num_hits == c->max_hits) {
+        max = c->max_hits ? 2 * c->max_hits : 64;
+        hits = realloc(c->hits, max * sizeof(*hits));
+        if (!hits) {
+            fprintf(stderr, "warning -- out of memory, dropping a match in %s\n",
+                    c->file->path);
+            return;
+        }
+        c->hits = hits;
+        c->max_hits = max;
+    }
+
+    c->hits[c->num_hits].line = line;
+    c->hits[c->num_hits].start = start;
+    c->hits[c->num_hits].len = len;
+    c->num_hits++;
+}
+
+/* Search a buffer holding whole lines of the file for "string" (or the
+ * patterns).  Rather than splitting the buffer into lines up front, we
+ * search the entire buffer and only work out the bounds and number of a
+ * line once it is known to contain a match.  Line numbers are just as
+ * lazy: the newlines between the previous match and this one are
+ * counted in one vectorized pass, and not at all if the caller has no
+ * use for line numbers.
+ * While the search can be cancelled the buffer is searched a slice at
+ * a time, polling the cancellation token in between.
+ * Every matching line is printed and counted (or, with -l/-c/-q, just
+ * counted; see scan_hit), along with its -A/-B context; context
+ * windows that touch or overlap are merged.  If "carry" is set, the
+ * line count is brought up to the end of the buffer so that the next
+ * block of the same file numbers correctly. */
+static void scan_buffer (struct scan_state* ss, const char* buf, size_t len, int carry)
+{
+    const char* end = buf + len;
+    const char* pos = buf;
+    const char* counted = buf;
+    const char* limit = end;
+    const char* printed = buf;
+    const char* match;
+    const char* line_start;
+    const char* line_end;
+    uint64_t start;
+    int sliced = cancellable();
+    int context = opt.output == OUTPUT_LINES && opt.context;
+
+    if (ss->done)
+        return;
+
+    start = stats_start();
+    ss->bytes += len;
+    if (ss->binary) {
+        scan_binary(ss, buf, len);
+        stats_stop(start, PHASE_SEARCH);
+        return;
+    }
+
+    while (pos < end) {
+        /* slices end after a newline, so that -w and "$" see the end
+         * of the slice as the end of a line; a line longer than the
+         * slice is searched in one go */
+        if (sliced && end - pos > CANCEL_SLICE) {
+            line_end = memrchr(pos, '\n', CANCEL_SLICE);
+            limit = line_end ? line_end + 1 : end;
+        }
+        else
+            limit = end;
+
+        match = scan_find(ss, pos, limit - pos);
+        if (!match) {
+            if (limit == end)
+                break;
+            if (cancelled()) {
+                ss->done = 1;
+                break;
+            }
+            pos = limit;
+            continue;
+        }
+
+        if (opt.output != OUTPUT_LINES) {
+            if (scan_hit(ss))
+                break;
+            /* -c: on to the next line */
+            line_end = memchr(match, '\n', end - match);
+            pos = line_end ? line_end + 1 : end;
+            continue;
+        }
+
+        /* pos always sits at the start of a line, so the line holding
+         * the match can't begin before it */
+        line_start = memrchr(pos, '\n', match - pos);
+        line_start = line_start ? line_start + 1 : pos;
+        line_end = memchr(match, '\n', end - match);
+        line_end = line_end ? line_end + 1 : end;
+
+        if (!claim_match()) {
+            ss->done = 1;
+            break;
+        }
+
+        /* which of the patterns are on the line */
+        if (ss->tally)
+            ac_tally_line(ss->ac, line_start, line_end - line_start, ss->tally);
+
+        if (ss->line_numbers) {
+            ss->line_number += search_count(counted, line_start - counted, '\n');
+            counted = line_start;
+        }
+
+        if (ss->chunk) {
+            chunk_add_hit(ss->chunk, ss->line_number, line_start, line_end - line_start);
+            ss->matches++;
+            pos = line_end;
+            continue;
+        }
+
+        if (context) {
+            print_after(ss, printed, line_start);
+            print_before(ss, buf - ss->history, line_start, ss->line_number + 1);
+            ss->after_left = opt.after;
+            printed = line_end;
+        }
+
+        print_line(ss, ss->line_number + 1, line_start, line_end, ':');
+        ss->matches++;
+
+        if (!ss->item->seq && ss->out->len > OUTBUF_FLUSH_SIZE)
+            outbuf_flush_early(ss->out);
+
+        pos = line_end;
+    }
+
+    /* after context running on past the last match (into the next
+     * block, if there is one) */
+    if (context)
+        print_after(ss, printed, end);
+
+    if (carry && ss->line_numbers)
+        ss->line_number += search_count(counted, end - counted, '\n');
+
+    stats_stop(start, PHASE_SEARCH);
+}
+
+/* Fallback for files that can't be mapped (pipes, special files, files
+ * whose size isn't known up front): read large blocks and scan all the
+ * complete lines in each one, carrying the partial last line (and with
+ * -B, the lines before it) over into the next block.  Binary files
+ * have no lines to keep intact, so for those we carry just enough to
+ * catch a match straddling two blocks.  The thread's block buffer is
+ * reused from file to file unless a long line made it grow.  Failures
+ * are reported here; returns -1 after one. */
+static int scan_fd_blocks (struct scan_state* ss, int fd, struct thread_ctx* tc)
+{
+    char* buf;
+    char* tmp;
+    char* last_nl;
+    char* kept;
+    size_t size = SCAN_BLOCK_SIZE;
+    size_t fill = 0, keep, history = 0;
+    ssize_t n;
+    uint64_t start;
+    unsigned int i;
+    int probed = 0;
+
+    buf = tc->block_buf;
+    if (!buf) {
+        buf = malloc(size);
+        if (!buf) {
+            item_warning(stderr, "out of memory, skipping", ss->item);
+            return -1;
+        }
+    }
+    tc->block_buf = NULL;
+
+    while (1) {
+        if (fill == size) {
+            /* a single line longer than the buffer */
+            tmp = realloc(buf, 2 * size);
+            if (!tmp) {
+                item_warning(stderr, "out of memory, skipping the rest of", ss->item);
+                free(buf);
+                return -1;
+            }
+            buf = tmp;
+            size *= 2;
+        }
+
+        start = stats_start();
+        n = read(fd, buf + fill, size - fill);
+        stats_stop(start, PHASE_READ);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            item_warning_errno(stderr, "unable to read", ss->item, errno);
+        if (n <= 0)
+            break;
+
+        last_nl = memrchr(buf + fill, '\n', n);
+        fill += n;
+
+        if (!probed) {
+            scan_check_binary(ss, buf, fill);
+            probed = 1;
+        }
+
+        if (ss->done)
+            break;
+
+        if (ss->binary) {
+            scan_buffer(ss, buf, fill, 1);
+            if (ss->done)
+                break;
+
+            keep = ss->string_len ? ss->string_len - 1 : 0;
+            if (keep > fill)
+                keep = fill;
+            memmove(buf, buf + fill - keep, keep);
+            fill = keep;
+            continue;
+        }
+
+        if (!last_nl)
+            continue;
+
+        ss->history = history;
+        scan_buffer(ss, buf + history, last_nl + 1 - (buf + history), 1);
+        if (ss->done)
+            break;
+
+        /* -B: the last lines of the block are kept (in front of the
+         * partial line) as the context of a match early in the next */
+        kept = last_nl + 1;
+        for (i = 0; i < opt.before && kept > buf; i++) {
+            tmp = memrchr(buf, '\n', kept - 1 - buf);
+            kept = tmp ? tmp + 1 : buf;
+        }
+        history = last_nl + 1 - kept;
+        fill = buf + fill - kept;
+        memmove(buf, kept, fill);
+    }
+
+    /* the last line of the file need not end in a newline */
+    ss->history = history;
+    if (fill > history && !ss->done)
+        scan_buffer(ss, buf + history, fill - history, 0);
+
+    if (size == SCAN_BLOCK_SIZE)
+        tc->block_buf = buf;
+    else
+        free(buf);
+
+    return n < 0 ? -1 : 0;
+}
+
+
+static void scan_state_init (struct scan_state* ss, struct work_item* item, char* string,
+                             struct thread_ctx* tc)
+{
+    memset(ss, 0, sizeof(*ss));
+    ss->item = item;
+    ss->out = &tc->out;
+    ss->string = search_string ? search_string : string;
+    ss->string_len = strlen(ss->string);
+    ss->find = opt.icase ? search_find_icase : search_find;
+    ss->words = opt.words;
+    ss->line_numbers = opt.output == OUTPUT_LINES;
+
+    if (patterns_ac) {
+        ss->ac = patterns_ac;
+        ss->string_len = ac_max_len(patterns_ac);
+        if (opt.output == OUTPUT_LINES)
+            ss->tally = &tc->tally;
+    }
+
+    if (pattern_fuzzy) {
+        ss->fuzzy = pattern_fuzzy;
+        ss->pieces = fuzzy_string;
+        ss->num_pieces = num_fuzzy_pieces;
+        ss->string_len += opt.fuzzy;
+    }
+
+    if (pattern_rx) {
+        if (!tc->dfa)
+            tc->dfa = rx_dfa_new(pattern_rx);
+        ss->dfa = tc->dfa;
+        ss->literal = regex_literal;
+        ss->literal_len = regex_literal_len;
+        ss->string_len = rx_max_len(pattern_rx);
+        if (ss->string_len > REGEX_MAX_SPAN)
+            ss->string_len = REGEX_MAX_SPAN;
+        if (!ss->dfa) {
+            item_warning(stderr, "out of memory, skipping", item);
+            ss->done = 1;
+        }
+    }
+}
+
+static void scan_state_finish (struct scan_state* ss, struct thread_ctx* tc)
+{
+    /* -l and -c name the file once it is done (a chunk leaves that to
+     * split_file_finish) */
+    if (ss->matches && !ss->chunk
+            && (opt.output == OUTPUT_FILES || opt.output == OUTPUT_COUNT)) {
+        if (!ss->path)
+            ss->path = work_item_path(ss->item);
+        if (opt.output == OUTPUT_FILES)
+            outbuf_printf(ss->out, "%s\n", ss->path ? ss->path : ss->item->name);
+        else
+            outbuf_printf(ss->out, "%s:%u\n", ss->path ? ss->path : ss->item->name,
+                          ss->matches);
+    }
+
+    path_free(ss->path);
+    tc->num_occurences += ss->matches;
+    tc->bytes_scanned += ss->bytes;
+}
+
+/* offset of the first line of map[0..size) starting at or after "off" */
+static size_t line_start_at (const char* map, size_t size, size_t off)
+{
+    const char* nl;
+
+    if (off == 0 || off >= size)
+        return off < size ? off : size;
+
+    nl = memchr(map + off - 1, '\n', size - off + 1);
+    return nl ? nl - map + 1 : size;
+}
+
+/* Hand the mapped file "item" out to the pool in chunks, posting one
+ * WORK_CHUNK item for each.  The split file takes over the mapping and
+ * the item's place in the output order. */
+static int split_file (struct work_item* item, char* map, size_t size,
+                       post_work_t post_work, void* ctx)
+{
+    struct split_file* sf;
+    struct work_item* chunk_items = NULL;
+    struct work_item* chunk_item;
+    size_t i;
+
+    sf = calloc(1, sizeof(*sf));
+    if (!sf)
+        return -1;
+
+    sf->num_chunks = (size + SPLIT_CHUNK_SIZE - 1) / SPLIT_CHUNK_SIZE;
+    sf->chunks = calloc(sf->num_chunks, sizeof(*sf->chunks));
+    sf->path = work_item_path(item);
+    if (!sf->chunks || !sf->path)
+        goto fail;
+
+    /* chunks are only posted once all of them are set up, since the
+     * first may be finished before the last is posted */
+    for (i = sf->num_chunks; i-- > 0; ) {
+        chunk_item = work_item_new(NULL, "", 0, WORK_CHUNK);
+        if (!chunk_item)
+            goto fail;
+        chunk_item->chunk = &sf->chunks[i];
+        chunk_item->next = chunk_items;
+        chunk_items = chunk_item;
+
+        sf->chunks[i].file = sf;
+        sf->chunks[i].start = i * SPLIT_CHUNK_SIZE;
+        sf->chunks[i].end = i + 1 < sf->num_chunks ? (i + 1) * SPLIT_CHUNK_SIZE : size;
+    }
+
+    sf->map = map;
+    sf->size = size;
+    sf->seq = item->seq;
+    item->seq = NULL;
+    atomic_init(&sf->remaining, sf->num_chunks);
+
+    while ((chunk_item = chunk_items) != NULL) {
+        chunk_items = chunk_item->next;
+        chunk_item->next = NULL;
+        post_work(ctx, chunk_item);
+    }
+
+    return 0;
+
+fail:
+    while ((chunk_item = chunk_items) != NULL) {
+        chunk_items = chunk_item->next;
+        work_item_free(chunk_item);
+    }
+    free(sf->chunks);
+    path_free(sf->path);
+    free(sf);
+    return -1;
+}
+
+/* Search the open file "fd" (which is "item") for "string".  Regular
+ * files are mapped into memory and searched in place as a single
+ * buffer; the rest are read in large blocks.  If we find a line that
+ * contains the string, we print the name of the file, the line number,
+ * and the line itself (into the thread's output buffer).  The number of
+ * matching lines is added to the thread's count.  A big text file may
+ * instead be split into chunks posted through "post_work" (when the
+ * thread has others to share them with); 1 is returned then, and the
+ * output is produced once the last chunk is done.  Returns -1 (having
+ * said why) if the file couldn't be read. */
+int scan_fd (struct work_item* item, int fd, char* string, post_work_t post_work,
+             void* ctx, struct thread_ctx* tc)
+{
+    int ret = 0;
+    void* map;
+    struct stat file_stats;
+    struct scan_state ss;
+    uint64_t start;
+
+    scan_state_init(&ss, item, string, tc);
+
+    start = stats_start();
+    ret = fstat(fd, &file_stats);
+    stats_stop(start, PHASE_STAT);
+
+    if (ret == 0 && S_ISREG(file_stats.st_mode) && file_stats.st_size > 0) {
+        /* the pages of a mapped file are faulted in as they are
+         * searched, so most of its read time shows up as search */
+        start = stats_start();
+        map = mmap(NULL, file_stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+            madvise(map, file_stats.st_size, MADV_SEQUENTIAL);
+        stats_stop(start, PHASE_READ);
+        if (map != MAP_FAILED) {
+            scan_check_binary(&ss, map, file_stats.st_size);
+            /* -l and -q stop at the first match, which splitting would
+             * only get in the way of, and -A/-B need the lines around
+             * a match in order */
+            if (tc->split_files && !ss.binary && !opt.context
+                    && (opt.output == OUTPUT_LINES || opt.output == OUTPUT_COUNT)
+                    && file_stats.st_size >= 2 * SPLIT_CHUNK_SIZE
+                    && split_file(item, map, file_stats.st_size, post_work, ctx) == 0) {
+                ret = 1;
+                goto out;
+            }
+            scan_buffer(&ss, map, file_stats.st_size, 0);
+            munmap(map, file_stats.st_size);
+            ret = 0;
+            goto out;
+        }
+    }
+    ret = scan_fd_blocks(&ss, fd, tc);
+
+out:
+    scan_state_finish(&ss, tc);
+
+    return ret;
+}
+
+/* Search the complete contents of "item", already read into buf[0..len) */
+void scan_memory (struct work_item* item, const char* buf, size_t len,
+                  char* string, struct thread_ctx* tc)
+{
+    struct scan_state ss;
+
+    scan_state_init(&ss, item, string, tc);
+    scan_check_binary(&ss, buf, len);
+    scan_buffer(&ss, buf, len, 0);
+    scan_state_finish(&ss, tc);
+}
+
+/* All chunks of a split file are done: number the hits and print them
+ * in file order, then let the file go */
+static void split_file_finish (struct split_file* sf, struct thread_ctx* tc)
+{
+    struct chunk* c;
+    unsigned int base = 0, count = 0;
+    size_t i, j;
+
+    for (i = 0; i < sf->num_chunks; i++) {
+        c = &sf->chunks[i];
+        if (opt.output == OUTPUT_COUNT) {
+            count += c->num_hits;
+            continue;
+        }
+        for (j = 0; j < c->num_hits; j++) {
+            outbuf_printf(&tc->out, "%s:%u: ", sf->path, base + c->hits[j].line + 1);
+            outbuf_write(&tc->out, c->hits[j].start, c->hits[j].len);
+
+            if (!sf->seq && tc->out.len > OUTBUF_FLUSH_SIZE)
+                outbuf_flush_early(&tc->out);
+        }
+        base += c->newlines;
+        free(c->hits);
+    }
+    if (count)
+        outbuf_printf(&tc->out, "%s:%u\n", sf->path, count);
+
+    if (sf->seq)
+        seq_node_complete(sf->seq, &tc->out);
+    else
+        outbuf_flush(&tc->out);
+
+    munmap(sf->map, sf->size);
+    free(sf->chunks);
+    path_free(sf->path);
+    free(sf);
+}
+
+/* Scan the lines of one chunk of a split file, numbering them from the
+ * start of the chunk, and finish the file if it was the last one */
+static void handle_chunk (struct work_item* item, char* string, struct thread_ctx* tc)
+{
+    struct chunk* c = item->chunk;
+    struct split_file* sf = c->file;
+    struct scan_state ss;
+    size_t begin, end;
+
+    begin = line_start_at(sf->map, sf->size, c->start);
+    end = line_start_at(sf->map, sf->size, c->end);
+
+    scan_state_init(&ss, item, string, tc);
+    ss.chunk = c;
+    if (begin < end && !cancelled() && !ss.done)
+        scan_buffer(&ss, sf->map + begin, end - begin, 1);
+    else if (ss.line_numbers && begin < end)
+        /* not searched, but the chunks after it that were may have
+         * hits to number */
+        ss.line_number = search_count(sf->map + begin, end - begin, '\n');
+    c->newlines = ss.line_number;
+    scan_state_finish(&ss, tc);
+
+    if (atomic_fetch_sub(&sf->remaining, 1) == 1)
+        split_file_finish(sf, tc);
+}
+
+/* Search the file "item" for "string" (see scan_fd).  Returns -1 if it
+ * couldn't be opened or read, having warned about it. */
+int handle_file (struct work_item* item, char* string,
+                 post_work_t post_work, void* ctx, struct thread_ctx* tc)
+{
+    int fd, ret;
+    uint64_t start;
+
+    start = stats_start();
+    fd = work_item_open(item, O_RDONLY);
+    stats_stop(start, PHASE_OPEN);
+    if (fd < 0) {
+        item_warning_errno(stderr, "unable to open", item, errno);
+        return -1;
+    }
+
+    ret = scan_fd(item, fd, string, post_work, ctx, tc);
+    close(fd);
+
+    return ret;
+}
+
+
+/* Hand over the output collected for "item": to its place in the
+ * traversal order with --sorted, otherwise straight to stdout */
+static void item_output_done (struct work_item* item, struct thread_ctx* tc)
+{
+    uint64_t start = stats_start();
+
+    if (item->seq)
+        seq_node_complete(item->seq, &tc->out);
+    else
+        outbuf_flush(&tc->out);
+
+    stats_stop(start, PHASE_OUTPUT);
+}
+
+/* With --index, should the regular file "item" be passed over?  It is
+ * if the index has it, it isn't a candidate and it hasn't changed since
+ * (by inode, mtime and size, as --update-index tells).  Files that were
+ * added or changed are searched like any other, and counted. */
+static int index_rules_out (struct work_item* item)
+{
+    struct stat st;
+    char* path;
+    const char* name;
+    uint32_t id;
+    long found;
+    int ret = 0;
+
+    if (!search_index)
+        return 0;
+
+    path = work_item_path(item);
+    if (!path)
+        return 0;
+    name = path + index_root_len;
+    while (*name == '/')
+        name++;
+
+    found = index_find(search_index, name);
+    if (found >= 0) {
+        id = found;
+        if (bsearch(&id, index_ids, index_num_ids, sizeof(id), cmp_uint32))
+            ;   /* searched either way */
+        else if (work_item_lstat(item, &st) < 0)
+            ;   /* gone, or some such: the open will say */
+        else if (index_file_unchanged(search_index, id, &st))
+            ret = 1;
+        else
+            atomic_fetch_add_explicit(&index_stale, 1, memory_order_relaxed);
+    }
+    /* new since the index was built, unless it is the index itself */
+    else if (work_item_lstat(item, &st) < 0
+             || st.st_dev != index_self.st_dev || st.st_ino != index_self.st_ino)
+        atomic_fetch_add_explicit(&index_stale, 1, memory_order_relaxed);
+
+    path_free(path);
+
+    return ret;
+}
+
+/* Process a single work item: work out its file type and
+ * either scan it (file) or post its contents as new work (directory) */
+void handle_work_item (struct work_item* item, char* string,
+                       post_work_t post_work, void* ctx, struct thread_ctx* tc)
+{
+    int ret;
+    char* path;
+    struct stat file_stats;
+    uint64_t start;
+    unsigned char type = item->type;
+
+    if (type == WORK_CHUNK) {
+        handle_chunk(item, string, tc);
+        return;
+    }
+
+    /* -q has its answer; just let the rest of the work go */
+    if (cancelled())
+        goto out;
+
+    if (type == WORK_CURSOR) {
+        if (handle_cursor(item, post_work, ctx) < 0)
+            item_warning(stderr, "unable to decend into", item);
+        goto out;
+    }
+
+    /* the directory listing normally tells us the file type; only the
+     * starting path and file systems that don't fill in d_type need
+     * an lstat */
+    if (type == DT_UNKNOWN) {
+        start = stats_start();
+        ret = work_item_lstat(item, &file_stats);
+        stats_stop(start, PHASE_STAT);
+        if (ret < 0) {
+            item_warning(stderr, "unable to stat", item);
+            goto out;
+        }
+        type = IFTODT(file_stats.st_mode);
+
+        if (item->parent && filter_active()
+                && filter_skip(item->parent, item->name, type))
+            goto out;
+    }
+
+    /* if work item is a file, scan it for our string
+     * if work item is a directory, add its contents to the work queue */
+    if (type == DT_DIR) {
+        /* work item is a directory; descend into it and post work to the queue */
+        ret = handle_directory(item, post_work, ctx);
+        if (ret < 0) {
+            item_warning(stderr, "unable to decend into", item);
+        }
+    }
+    else if (type == DT_REG) {
+        /* work item is a file; scan it for our string, unless the index
+         * says it isn't there */
+        if (index_rules_out(item))
+            goto out;
+        stats_add(STAT_FILES, 1);
+        start = opt.file_times ? monotonic_ns() : 0;
+        handle_file(item, string, post_work, ctx, tc);
+        if (opt.file_times)
+            file_times_add(&tc->times, monotonic_ns() - start);
+    }
+    else if (type == DT_LNK) {
+        /* work item is a symbolic link -- do nothing */
+    }
+    else {
+        path = work_item_path(item);
+        outbuf_printf(&tc->out, "warning -- skipping file of unknown type %s\n",
+                      path ? path : item->name);
+        path_free(path);
+    }
+
+out:
+    item_output_done(item, tc);
+}
+
+
+static void serial_post_work (void* ctx, struct work_item* item)
+{
+    budget_queued(item);
+    if (over_budget())
+        queue_push_front((queue_t*)ctx, item);
+    else
+        enqueue((queue_t*)ctx, item);
+}
+
+static struct work_item* serial_get_work (queue_t* queue)
+{
+    struct work_item* item = dequeue(queue);
+
+    if (item)
+        budget_dequeued(item);
+
+    return item;
+}
+
+/* The files the index says may contain "string" or, with several
+ * patterns, any one of them: the union of each one's candidates, in
+ * file id order.  With --fuzzy the pieces of the string stand in for
+ * the patterns.  Returns -1 if the index can't rule anything out. */
+static long lookup_candidates (struct index* idx, char* string, uint32_t** ids)
+{
+    uint32_t* all = NULL;
+    uint32_t* more;
+    uint32_t* tmp;
+    long num = 0, n, i, j;
+    size_t p, pieces;
+
+    if (pattern_rx) {
+        if (!regex_literal)
+            return -1;
+        return index_candidates(idx, regex_literal, regex_literal_len, ids);
+    }
+    if (search_string)
+        return index_candidates(idx, search_string, strlen(search_string), ids);
+    if (!patterns_ac && !pattern_fuzzy)
+        return index_candidates(idx, string, strlen(string), ids);
+
+    pieces = pattern_fuzzy ? opt.fuzzy + 1 : num_patterns;
+    for (p = 0; p < pieces; p++) {
+        if (pattern_fuzzy)
+            n = index_candidates(idx, fuzzy_string + fuzzy_bounds[p],
+                                 fuzzy_bounds[p + 1] - fuzzy_bounds[p], &more);
+        else
+            n = index_candidates(idx, patterns[p], strlen(patterns[p]), &more);
+        if (n < 0) {
+            free(all);
+            return -1;
+        }
+        tmp = realloc(all, (num + n + 1) * sizeof(*all));
+        if (!tmp) {
+            free(more);
+            free(all);
+            return -1;
+        }
+        all = tmp;
+        if (n)
+            memcpy(all + num, more, n * sizeof(*all));
+        num += n;
+        free(more);
+    }
+
+    qsort(all, num, sizeof(*all), cmp_uint32);
+    for (i = 0, j = 0; i < num; i++)
+        if (!j || all[j - 1] != all[i])
+            all[j++] = all[i];
+
+    *ids = all;
+    return j;
+}
+
+/* Done with the index; say so if the tree has moved on since it was
+ * built */
+static void index_search_close (void)
+{
+    unsigned long stale = atomic_load(&index_stale);
+
+    if (stale)
+        fprintf(stderr, "warning -- index %s is out of date: %lu file(s) added or "
+                "changed since it was built were searched in full (see --update-index)\n",
+                opt.index, stale);
+
+    index_close(search_index);
+    search_index = NULL;
+    free(index_ids);
+    index_ids = NULL;
+    index_num_ids = 0;
+}
 
-/***** REUSED FROM HW5 *******************************/
-struct workers_state {
-    pthread_mutex_t mutex;
-    pthread_cond_t signal;
-};
+/* Open the index for a search of "path" and look up which of its files
+ * may contain "string".  Returns -1, having said why if it isn't
+ * obvious, if the index is no use for this search; the whole tree is
+ * then read as if there were none. */
+static int index_search_open (char* path, char* string)
+{
+    char* real;
 
-static struct workers_state wstate = {
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
-    .signal = PTHREAD_COND_INITIALIZER
-};
-/****************************************************/
+    search_index = index_open(opt.index);
+    if (!search_index) {
+        fprintf(stderr, "warning -- unable to read index %s: %s\n", opt.index,
+                strerror(errno));
+        return -1;
+    }
 
-/***************************/
+    real = realpath(path, NULL);
+    if (!real || strcmp(real, index_root(search_index))) {
+        fprintf(stderr, "warning -- index %s was built for %s, not %s\n",
+                opt.index, index_root(search_index), path);
+        free(real);
+        index_search_close();
+        return -1;
+    }
+    free(real);
 
-/***** GLOBAL VARIABLES ******************************/
-static unsigned int num_occurences = 0;
-queue_t work_queue = QUEUE_INITIALIZER;
+    index_num_ids = lookup_candidates(search_index, string, &index_ids);
+    if (index_num_ids < 0) {
+        index_search_close();
+        return -1;
+    }
 
-int ret;
-struct stat file_stats;
-char current_path[PATH_MAX];
-char* string;
-unsigned int num_rem_threads = NUM_WORKER_THREADS;
+    index_root_len = strlen(path);
+    stat(opt.index, &index_self);
 
-/***************************/
+    return 0;
+}
 
-/* adds the contents path to the queue */
-void enqueue (queue_t* head, char* path)
+/* Post the first work: the path specified on the command line.  With
+ * --sorted, "seq" is the root of the traversal order. */
+static void post_initial_work (char* path, post_work_t post_work, void* ctx,
+                               struct seq_node* seq)
 {
-    queue_t next = *head;
+    struct work_item* item;
+    struct outbuf none = { 0 };
 
-    *head = malloc(sizeof(**head));
-    (*head)->next = next;
-    strcpy((*head)->path, path);
+    item = work_item_new(NULL, path, strlen(path), DT_UNKNOWN);
+    if (!item) {
+        fprintf(stderr, "error -- out of memory, unable to search %s\n", path);
+        /* there is nothing to wait for */
+        if (seq)
+            seq_node_complete(seq, &none);
+        return;
+    }
+    item->seq = seq;
+    post_work(ctx, item);
 }
 
-/* removes the oldest item from the queue and populates it into path.
- * if the queue is empty, path is populated with NULL */
-void dequeue(queue_t* head, char* path)
+/* Given a starting path, minigrep_simple using a single thread
+ * to recursively search all files and directories within path
+ * for the specified string */
+void minigrep_simple (char* path, char* string)
 {
-    queue_t  cur = *head;
-    queue_t* pp = head;
+    queue_t work_queue;
+    struct work_item* item;
+    struct thread_ctx tc = { 0 };
+    struct seq_node* root_seq = NULL;
+    struct seq_merge merge;
 
-    while (cur) {
-        if (cur->next == NULL) {
-            strcpy(path, cur->path);
-            *pp = cur->next;
-            free(cur);
-            return;
+    if (queue_init(&work_queue, QUEUE_CAPACITY) < 0) {
+        fprintf(stderr, "error -- unable to allocate work queue\n");
+        return;
+    }
+
+    stats_attach(&tc.stats);
+    slab_attach(&tc.slab);
+
+    /* the FIFO queue visits the tree breadth first, which is the order
+     * output is expected in, but over the --queue-memory budget the
+     * traversal goes depth first: put the output back in order the way
+     * -P --sorted does, printing whatever is ready after each item */
+    if (opt.queue_memory) {
+        root_seq = seq_node_new();
+        if (!root_seq) {
+            fprintf(stderr, "error -- out of memory\n");
+            exit(EXIT_FAILURE);
         }
+        seq_merge_start(&merge, root_seq);
+    }
+    post_initial_work(path, serial_post_work, &work_queue, root_seq);
 
-        pp = &cur->next;
-        cur = cur->next;
+    /* While there is work in the queue, process it. */
+    while ((item = serial_get_work(&work_queue)) != NULL) {
+        handle_work_item(item, string, serial_post_work, &work_queue, &tc);
+        work_item_free(item);
+        stats_queue_length(queue_length(&work_queue));
+        if (root_seq)
+            seq_merge_step(&merge, 0);
     }
+    if (root_seq)
+        seq_merge_step(&merge, 1);
+    stats_attach(NULL);
+    slab_detach();
+    queue_destroy(&work_queue);
+    thread_ctx_merge(&tc);
+
+    print_summary(string);
 }
-/***************************/
 
 
-/***** HELPER FUCTIONS: CODE TIMING ******************/
-void stopwatch_start (stopwatch_t* sw)
+/* Take the pool's idle lock, timing the wait (--stats) if someone
+ * else has it */
+static void pool_lock (struct pool* pool)
 {
-    gettimeofday(&sw->start, NULL);
+    uint64_t start;
+
+    if (pthread_mutex_trylock(&pool->idle_lock) == 0)
+        return;
+
+    start = stats_start();
+    pthread_mutex_lock(&pool->idle_lock);
+    if (start) {
+        stats_add(STAT_LOCK_WAITS, 1);
+        stats_add(STAT_LOCK_WAIT_NS, monotonic_ns() - start);
+    }
 }
 
-float stopwatch_report (stopwatch_t* sw)
+/* Post a new work item to the calling worker's own queue and wake
+ * an idle worker (if any) so that it can come and steal it */
+static void pool_post_work (void* ctx, struct work_item* item)
 {
-    struct timeval stop;
+    struct worker* self = ctx;
+    struct pool* pool = self->pool;
 
-    gettimeofday(&stop, NULL);
-    return (float)(stop.tv_sec - sw->start.tv_sec + (stop.tv_usec - sw->start.tv_usec)/1000000.0);
+    atomic_fetch_add(&pool->pending, 1);
+    stats_queue_length(atomic_fetch_add(&pool->queued, 1) + 1);
+    budget_queued(item);
+    if (over_budget())
+        queue_push_front(&self->queue, item);
+    else
+        enqueue(&self->queue, item);
+
+    if (atomic_load(&pool->num_idle)) {
+        pool_lock(pool);
+        pthread_cond_signal(&pool->idle_signal);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
 }
-/***************************/
 
+/* Mark a work item as fully processed.  The last one out wakes
+ * everybody up so that the pool can shut down. */
+static void pool_complete_work (struct pool* pool)
+{
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pool_lock(pool);
+        pthread_cond_broadcast(&pool->idle_signal);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
 
-/***** HELPER FUCTIONS: PRINT USAGE ******************/
-void print_usage (char* prog)
+/* Take a work item for "self" without blocking: first from its own
+ * queue, then by stealing from the other workers (both in FIFO order, see
+ * dequeue).  Returns NULL if there is nothing to take right now. */
+static struct work_item* pool_find_work (struct worker* self)
 {
-    printf("Usage: %s mode path string \n\n", prog);
-    printf("    mode    -   either -S for single thread or -P for pthreads\n");
-    printf("    path    -   recursively scan all files in this path and report\n");
-    printf("                   all occurances of string\n");
-    printf("    string  -   scan files for this string\n\n");
+    struct pool* pool = self->pool;
+    unsigned int i, victim;
+    struct work_item* item;
+
+    item = dequeue(&self->queue);
+    if (item)
+        goto found;
+
+    /* start stealing at a random victim to spread out contention */
+    self->rand_state = self->rand_state * 1103515245 + 12345;
+    victim = (self->rand_state >> 16) % pool->num_workers;
+    for (i = 0; i < pool->num_workers; i++) {
+        struct worker* w = &pool->workers[(victim + i) % pool->num_workers];
+
+        if (w == self)
+            continue;
+
+        item = dequeue(&w->queue);
+        if (item)
+            goto found;
+    }
+
+    return NULL;
+
+found:
+    atomic_fetch_sub(&pool->queued, 1);
+    budget_dequeued(item);
+    return item;
 }
-/***************************/
 
+/* Get the next work item for "self", sleeping while there is nothing to
+ * take but other workers are still producing.  Returns NULL once all
+ * work has been completed. */
+static struct work_item* pool_get_work (struct worker* self)
+{
+    struct pool* pool = self->pool;
+    struct work_item* item;
+    uint64_t start;
 
+    while (1) {
+        item = pool_find_work(self);
+        if (item)
+            return item;
 
+        /* nothing to do: sleep until work is posted or the search is done */
+        start = stats_start();
+        pool_lock(pool);
+        atomic_fetch_add(&pool->num_idle, 1);
+        while (!atomic_load(&pool->queued) && atomic_load(&pool->pending))
+            pthread_cond_wait(&pool->idle_signal, &pool->idle_lock);
+        atomic_fetch_sub(&pool->num_idle, 1);
+        pthread_mutex_unlock(&pool->idle_lock);
+        stats_stop(start, PHASE_IDLE);
 
-/******************************************************************************
- *********************  M I N I   G R E P   S T A R T *************************
- ******************************************************************************/
+        if (!atomic_load(&pool->pending))
+            return NULL;
+    }
+}
 
-/* Decend into the directory located at "current_path" and add all
- * the files and/or directories it contains to the work_queue */
-unsigned int handle_directory (queue_t* work_queue, char* current_path)
+void* worker_thread (void* param)
 {
-    DIR *ptr_dir = NULL;
-    struct dirent *ptr_result;
-    char new_path[PATH_MAX];
+    struct worker* self = param;
+    struct work_item* item;
 
-    ptr_dir = opendir(current_path);
-    if (!ptr_dir)
-        return -1;
+    stats_attach(&self->ctx.stats);
+    slab_attach(&self->ctx.slab);
+    while ((item = pool_get_work(self)) != NULL) {
+        handle_work_item(item, string, pool_post_work, self, &self->ctx);
+        work_item_free(item);
+        pool_complete_work(self->pool);
+    }
+    slab_detach();
 
-    /* scan through all files within the directory */
-    while (1) {
-        /* obtain a pointer to the current directory entry and store
-         * it in ptr_entry.  if ptr_result is NULL, we have
-         * cycled through all items in the directory */
-        ptr_result = readdir(ptr_dir);
+    return NULL;
+}
 
-        if (ptr_result == NULL)
-            break;
 
-        /* Ignore "." (this directory) and ".." (parent directory) */
-        if (!strcmp(ptr_result->d_name, ".") || !strcmp(ptr_result->d_name, ".."))
-            continue;
+/* A read buffer for a file of "size" bytes: a spare one that is big
+ * enough if there is one, else a new one */
+static char* uring_get_buf (struct worker* self, size_t size, size_t* buf_size)
+{
+    unsigned int i;
+    char* buf;
 
-        /* add the file or directory to the work queue */
-        strcpy(new_path, current_path);
-        strcat(new_path, "/");
-        strcat(new_path, ptr_result->d_name);
-        enqueue(work_queue, new_path);
+    for (i = 0; i < self->num_spare; i++) {
+        if (self->spare_sizes[i] >= size) {
+            buf = self->spare_bufs[i];
+            *buf_size = self->spare_sizes[i];
+            self->num_spare--;
+            self->spare_bufs[i] = self->spare_bufs[self->num_spare];
+            self->spare_sizes[i] = self->spare_sizes[self->num_spare];
+            return buf;
+        }
     }
-    closedir(ptr_dir);
 
-    return 0;
+    /* none fits; make room for the new one among the spares */
+    if (self->num_spare) {
+        self->num_spare--;
+        free(self->spare_bufs[self->num_spare]);
+    }
+
+    if (size < URING_MIN_BUF)
+        size = URING_MIN_BUF;
+    buf = malloc(size);
+    *buf_size = buf ? size : 0;
+
+    return buf;
 }
 
+static void uring_put_buf (struct worker* self, char* buf, size_t buf_size)
+{
+    if (buf && buf_size <= URING_KEEP_SIZE && self->num_spare < URING_DEPTH) {
+        self->spare_bufs[self->num_spare] = buf;
+        self->spare_sizes[self->num_spare] = buf_size;
+        self->num_spare++;
+    }
+    else
+        free(buf);
+}
 
-/* Search the file located at "current_path" for "string" line-by-line.
- * If we find a line that contains the string, we print the name of
- * the file, the line number, and the line itself. */
-unsigned int handle_file (char* current_path, char* string)
+/* A file is done with the ring: release everything it holds */
+static void uring_finish (struct worker* self, struct file_op* op)
 {
-    FILE *fp;
-    char *offset;
+    if (op->fd >= 0)
+        close(op->fd);
+    if (op->name != op->item->name)
+        path_free((char*)op->name);
+    uring_put_buf(self, op->buf, op->buf_size);
+    if (opt.file_times)
+        file_times_add(&self->ctx.times, monotonic_ns() - op->start);
+    item_output_done(op->item, &self->ctx);
+    work_item_free(op->item);
 
-    size_t len = 0;
-    char* line = NULL;
-    unsigned int line_number = 0;
+    /* the last one in flight takes its place */
+    self->ops[op->slot] = self->ops[--self->inflight];
+    self->ops[op->slot]->slot = op->slot;
+    slab_free(op, sizeof(*op));
 
-    fp = fopen(current_path, "r");
-    if (fp == NULL)
-        return -1;
+    pool_complete_work(self->pool);
+}
 
-    while (getline(&line, &len, fp) != -1 ) {
-        line_number++;
+/* Queue an asynchronous open of the regular file "item" */
+static int uring_submit_open (struct worker* self, struct work_item* item)
+{
+    struct io_uring_sqe* sqe;
+    struct file_op* op;
+    int dirfd;
 
-        /* get offset of substring "string" within the string "line" */
-        offset = strstr(line, string);
-        if (offset != NULL) {
-            printf("%s:%u: %s", current_path, line_number, line);
-            num_occurences++;
-        }
+    op = slab_alloc(sizeof(*op));
+    if (!op)
+        return -1;
+    memset(op, 0, sizeof(*op));
+
+    op->item = item;
+    op->fd = -1;
+    if (opt.file_times)
+        op->start = monotonic_ns();
+    dirfd = work_item_resolve(item, &op->name);
+    if (!op->name) {
+        slab_free(op, sizeof(*op));
+        return -1;
     }
-    fclose(fp);
-    free(line);
+
+    /* never fails: each file in flight holds at most one entry and the
+     * ring has at least URING_DEPTH of them */
+    sqe = uring_get_sqe(self->ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t)op->name;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = (uintptr_t)op;
+    op->slot = self->inflight;
+    self->ops[self->inflight++] = op;
+    stats_add(STAT_FILES, 1);
 
     return 0;
 }
 
+/* Queue a read of the rest of the file into op->buf */
+static void uring_submit_read (struct worker* self, struct file_op* op)
+{
+    struct io_uring_sqe* sqe;
 
-/* Given a starting path, minigrep_simple using a single thread
- * to recursively search all files and directories within path
- * for the specified string */
-void minigrep_simple (char* path, char* string)
+    sqe = uring_get_sqe(self->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = op->fd;
+    sqe->addr = (uintptr_t)(op->buf + op->len);
+    sqe->len = op->size - op->len;
+    sqe->off = op->len;
+    sqe->user_data = (uintptr_t)op;
+}
+
+/* Move a file to its next stage once its open or read completes with
+ * result "res" */
+static void uring_complete (struct worker* self, struct file_op* op, int res)
 {
-    /* the path specified on the command line is the first work item */
-    enqueue(&work_queue, path);
-    /* While there is work in the queue, process it. */
-    while(work_queue != NULL){
-
-        /* get the next item from the work queue */
-        dequeue(&work_queue, current_path);
-        /* and retrieve its file type information */
-        lstat(current_path, &file_stats);
-
-        /* if work item is a file, scan it for our string
-         * if work item is a directory, add its contents to the work queue */
-        if (S_ISDIR(file_stats.st_mode)) {
-            /* work item is a directory; descend into it and post work to the queue */
-            ret = handle_directory(&work_queue, current_path);
-            if (ret < 0) {
-                fprintf(stderr, "warning -- unable to decend into %s\n", current_path);
-                continue;
-            }
-        }
-        else if (S_ISREG(file_stats.st_mode)) {
-            /* work item is a file; scan it for our string */
-            ret = handle_file(current_path, string);
-            if (ret < 0) {
-                fprintf(stderr, "warning -- unable to open %s\n", current_path);
-                continue;
-            }
+    struct stat file_stats;
+    uint64_t start;
+
+    if (op->fd < 0) {
+        /* the open finished */
+        if (res < 0) {
+            item_warning_errno(stderr, "unable to open", op->item, -res);
+            uring_finish(self, op);
+            return;
         }
-        else if (S_ISLNK(file_stats.st_mode)) {
-            /* work item is a symbolic link -- do nothing */
+        op->fd = res;
+        if (cancelled()) {
+            uring_finish(self, op);
+            return;
         }
-        else {
-            printf("warning -- skipping file of unknown type %s\n", current_path);
+
+        start = stats_start();
+        res = fstat(op->fd, &file_stats);
+        stats_stop(start, PHASE_STAT);
+
+        if (res == 0 && S_ISREG(file_stats.st_mode)
+                && file_stats.st_size > 0 && file_stats.st_size <= URING_MAX_READ)
+            op->buf = uring_get_buf(self, file_stats.st_size, &op->buf_size);
+
+        if (!op->buf) {
+            /* big (or odd) files are better off mapped */
+            scan_fd(op->item, op->fd, string, pool_post_work, self, &self->ctx);
+            uring_finish(self, op);
+            return;
         }
+
+        op->size = file_stats.st_size;
+        uring_submit_read(self, op);
+        return;
+    }
+
+    /* a read finished */
+    if (res < 0) {
+        item_warning_errno(stderr, "unable to read", op->item, -res);
+        uring_finish(self, op);
+        return;
+    }
+
+    op->len += res;
+    if (res > 0 && op->len < op->size) {
+        /* short read; go back for the rest */
+        uring_submit_read(self, op);
+        return;
     }
 
-    printf("\n\nFound %u instance(s) of string \"%s\".\n", num_occurences, string);
+    scan_memory(op->item, op->buf, op->len, string, &self->ctx);
+    uring_finish(self, op);
 }
 
-void* worker_thread (void* param)
+/* The ring failed with "err", and not in a way that waiting out will
+ * fix.  Tearing it down cancels whatever the kernel still has of ours;
+ * the files that were in flight are then searched the ordinary way,
+ * from the start, and so is the rest of this worker's share.  Their
+ * read buffers are left alone rather than freed: the cancelled reads
+ * may not have let go of them yet. */
+static void uring_fail_over (struct worker* self, int err)
 {
-    pthread_mutex_lock(&wstate.mutex);
-
-    if (work_queue != NULL) {
-        /* get the next item from the work queue */
-        dequeue(&work_queue, current_path);
-        /* and retrieve its file type information */
-        lstat(current_path, &file_stats);
-
-        /* if work item is a file, scan it for our string
-         * if work item is a directory, add its contents to the work queue */
-        if (S_ISDIR(file_stats.st_mode)) {
-            /* work item is a directory; descend into it and post work to the queue */
-            ret = handle_directory(&work_queue, current_path);
-            if (ret < 0) {
-                fprintf(stderr, "warning -- unable to decend into %s\n", current_path);
+    struct file_op* op;
+
+    fprintf(stderr, "warning -- io_uring failed (%s), reading files directly\n",
+            strerror(err));
+    uring_destroy(self->ring);
+    free(self->ring);
+    self->ring = NULL;
+
+    while (self->inflight) {
+        op = self->ops[self->inflight - 1];
+        if (op->fd >= 0)
+            scan_fd(op->item, op->fd, string, pool_post_work, self, &self->ctx);
+        else if (!cancelled())
+            handle_file(op->item, string, pool_post_work, self, &self->ctx);
+        op->buf = NULL;
+        uring_finish(self, op);
+    }
+}
+
+/* The -U flavor of worker_thread.  Directories (and anything whose type
+ * isn't known) are handled synchronously as usual, but regular files are
+ * opened and read through the worker's io_uring so that up to "depth"
+ * of them are in flight at once; each is scanned as soon as its data
+ * lands. */
+void* uring_worker_thread (void* param)
+{
+    struct worker* self = param;
+    struct io_uring_cqe* cqe;
+    struct work_item* item;
+    struct file_op* op;
+    uint64_t start;
+    int res;
+
+    stats_attach(&self->ctx.stats);
+    slab_attach(&self->ctx.slab);
+    while (1) {
+        /* top up the ring.  only block waiting for new work if there is
+         * nothing of our own in flight */
+        while (self->inflight < self->depth) {
+            item = self->inflight ? pool_find_work(self) : pool_get_work(self);
+            if (!item)
+                break;
+
+            if (item->type == DT_REG && !cancelled() && index_rules_out(item)) {
+                item_output_done(item, &self->ctx);
+                work_item_free(item);
+                pool_complete_work(self->pool);
             }
-        }
-        else if (S_ISREG(file_stats.st_mode)) {
-            /* work item is a file; scan it for our string */
-            ret = handle_file(current_path, string);
-            if (ret < 0) {
-                fprintf(stderr, "warning -- unable to open %s\n", current_path);
+            else if (item->type != DT_REG || cancelled()
+                     || uring_submit_open(self, item) < 0) {
+                handle_work_item(item, string, pool_post_work, self, &self->ctx);
+                work_item_free(item);
+                pool_complete_work(self->pool);
             }
         }
-        else if (S_ISLNK(file_stats.st_mode)) {
-            /* work item is a symbolic link -- do nothing */
+
+        /* pool_get_work said the search is over */
+        if (!self->inflight)
+            break;
+
+        start = stats_start();
+        res = uring_submit_and_wait(self->ring, 1);
+        stats_stop(start, PHASE_READ);
+        if (res < 0 && errno != EAGAIN && errno != EBUSY) {
+            uring_fail_over(self, errno);
+            slab_detach();
+            return worker_thread(self);
         }
-        else {
-            printf("warning -- skipping file of unknown type %s\n", current_path);
+        while ((cqe = uring_peek_cqe(self->ring)) != NULL) {
+            op = (struct file_op*)(uintptr_t)cqe->user_data;
+            res = cqe->res;
+            uring_cqe_seen(self->ring);
+            uring_complete(self, op, res);
         }
-        num_rem_threads--;
     }
-    else {
-        num_rem_threads = 0;
+    slab_detach();
+
+    return NULL;
+}
+
+/* Give every worker its own io_uring.  Returns -1 (having cleaned up)
+ * if the kernel doesn't offer io_uring or the operations we need. */
+static int pool_setup_urings (struct pool* pool)
+{
+    unsigned int i;
+    int depth;
+    struct uring* ring;
+
+    /* share out the descriptors not set aside for directories, keeping
+     * back stdio plus a ring and a directory listing per worker */
+    depth = ((int)path_spare_fds() - 3 - 2 * (int)pool->num_workers)
+            / (int)pool->num_workers;
+    if (depth > URING_DEPTH)
+        depth = URING_DEPTH;
+    if (depth < 1)
+        depth = 1;
+
+    for (i = 0; i < pool->num_workers; i++) {
+        pool->workers[i].depth = depth;
+        ring = malloc(sizeof(*ring));
+        if (!ring || uring_init(ring, URING_DEPTH) < 0) {
+            free(ring);
+            goto fail;
+        }
+        pool->workers[i].ring = ring;
+
+        if (!uring_supports(ring, IORING_OP_OPENAT)
+                || !uring_supports(ring, IORING_OP_READ))
+            goto fail;
     }
 
-    pthread_mutex_unlock(&wstate.mutex);
+    return 0;
+
+fail:
+    for (i = 0; i < pool->num_workers; i++) {
+        if (pool->workers[i].ring) {
+            uring_destroy(pool->workers[i].ring);
+            free(pool->workers[i].ring);
+            pool->workers[i].ring = NULL;
+        }
+    }
 
-    pthread_cond_signal(&wstate.signal);
+    return -1;
 }
 
-/* Given a starting path, minigrep_pthreads uses multiple threads
+/* Given a starting path, minigrep_pthreads uses a pool of worker threads
  * to recursively search all files and directories within path
- * for the specified string */
-void minigrep_pthreads(char* path, char* string)
+ * for the specified string.  With "use_uring" set, the workers read
+ * files through io_uring (falling back to plain reads if the kernel
+ * can't do that).  With --sorted, this thread merges the workers'
+ * output back into the order -S would have printed it in. */
+void minigrep_pthreads(char* path, char* string, int use_uring)
 {
     unsigned int i;
+    long num_cpus;
+    struct seq_node* root_seq = NULL;
+    struct pool pool = {
+        .idle_lock = PTHREAD_MUTEX_INITIALIZER,
+        .idle_signal = PTHREAD_COND_INITIALIZER
+    };
+
+    pool.num_workers = NUM_WORKER_THREADS;
+    if (!pool.num_workers) {
+        num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pool.num_workers = num_cpus > 0 ? num_cpus : 1;
+    }
+
+    pool.workers = calloc(pool.num_workers, sizeof(*pool.workers));
+    if (!pool.workers) {
+        fprintf(stderr, "error -- unable to allocate worker pool\n");
+        return;
+    }
 
-    /* the path specified on the command line is the first work item */
-    enqueue(&work_queue, path);
+    for (i = 0; i < pool.num_workers; i++) {
+        pool.workers[i].id = i;
+        pool.workers[i].rand_state = i + 1;
+        pool.workers[i].pool = &pool;
+        pool.workers[i].ctx.split_files = pool.num_workers > 1;
+        if (queue_init(&pool.workers[i].queue, QUEUE_CAPACITY) < 0) {
+            fprintf(stderr, "error -- unable to allocate worker pool\n");
+            /* no thread has started yet; undo the queues set up so far */
+            while (i--)
+                queue_destroy(&pool.workers[i].queue);
+            free(pool.workers);
+            return;
+        }
+    }
+
+    if (use_uring && pool_setup_urings(&pool) < 0)
+        fprintf(stderr, "warning -- io_uring unavailable, using the thread pool\n");
 
-    while(work_queue != NULL){
-        num_rem_threads = NUM_WORKER_THREADS;
-        /* Create NUM_WORKER_THREADS threads */
-        for(i = 0; i < NUM_WORKER_THREADS; i++){
-            pthread_t tid;
-            pthread_create(&tid, NULL, worker_thread, NULL);
-            pthread_detach(tid);
+    if (opt.sorted)
+        root_seq = seq_node_new();
+    post_initial_work(path, pool_post_work, &pool.workers[0], root_seq);
+
+    for (i = 0; i < pool.num_workers; i++)
+        pthread_create(&pool.workers[i].tid, NULL,
+                       pool.workers[i].ring ? uring_worker_thread : worker_thread,
+                       &pool.workers[i]);
+
+    if (root_seq)
+        seq_merge(root_seq);
+
+    for (i = 0; i < pool.num_workers; i++) {
+        pthread_join(pool.workers[i].tid, NULL);
+        thread_ctx_merge(&pool.workers[i].ctx);
+        if (pool.workers[i].ring) {
+            uring_destroy(pool.workers[i].ring);
+            free(pool.workers[i].ring);
         }
+        while (pool.workers[i].num_spare)
+            free(pool.workers[i].spare_bufs[--pool.workers[i].num_spare]);
+    }
 
-        /* While there is work in the queue, process it. */
-        pthread_mutex_lock(&wstate.mutex);
-        while(num_rem_threads){
-            /* Block using condition variable while there are still working threads */
-            pthread_cond_wait(&wstate.signal, &wstate.mutex);
+    /* only tear down the queues once nobody can be stealing from them */
+    for (i = 0; i < pool.num_workers; i++)
+        queue_destroy(&pool.workers[i].queue);
+    free(pool.workers);
+
+    print_summary(string);
+}
+
+
+/* Add the regular file "item" to the index being built.  Its name is
+ * recorded relative to the root, whose path is root_len bytes long.
+ * When updating the index "old", a file whose inode, mtime and size
+ * haven't changed is carried over without being read.  Returns 1 if
+ * the file was read, 0 if it was carried over and -1 if it was left
+ * out. */
+static int index_add_file (struct index_builder* b, struct index* old,
+                           struct work_item* item, size_t root_len,
+                           const struct stat* skip)
+{
+    struct stat st;
+    void* map = NULL;
+    char* path;
+    const char* name;
+    long id;
+    int fd, unindexed, ret = -1;
+
+    path = work_item_path(item);
+    if (!path) {
+        fprintf(stderr, "warning -- out of memory, not indexing %s\n", item->name);
+        return -1;
+    }
+    name = path + root_len;
+    while (*name == '/')
+        name++;
+
+    if (old && (id = index_find(old, name)) >= 0 && work_item_lstat(item, &st) == 0
+            && index_file_unchanged(old, id, &st)) {
+        ret = 0;
+        if (index_builder_reuse(b, old, id) < 0) {
+            fprintf(stderr, "warning -- out of memory indexing %s\n", path);
+            ret = -1;
         }
-        pthread_mutex_unlock(&wstate.mutex);
+        path_free(path);
+        return ret;
+    }
+
+    fd = work_item_open(item, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        item_warning(stderr, "unable to open", item);
+        if (fd >= 0)
+            close(fd);
+        path_free(path);
+        return -1;
+    }
+
+    /* don't index an old copy of the index itself */
+    if (st.st_dev == skip->st_dev && st.st_ino == skip->st_ino) {
+        close(fd);
+        path_free(path);
+        return -1;
+    }
+
+    unindexed = st.st_size > INDEX_MAX_FILE_SIZE;
+    if (!unindexed && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+        else
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+        unindexed = !map || looks_binary(map, st.st_size < BINARY_PROBE_SIZE ?
+                                              st.st_size : BINARY_PROBE_SIZE);
     }
+    close(fd);
+
+    if (index_builder_add(b, name, &st, map, map ? st.st_size : 0, unindexed) < 0)
+        fprintf(stderr, "warning -- out of memory indexing %s\n", path);
+    else
+        ret = 1;
+    path_free(path);
 
-    printf("\n\nFound %u instance(s) of string \"%s\".\n", num_occurences, string);
+    if (map)
+        munmap(map, st.st_size);
+
+    return ret;
 }
 
+/* Walk the tree at "path" the way minigrep_simple does and write a
+ * trigram index of every regular file in it to "file".  With "update",
+ * the index already in "file" is brought up to date instead: only the
+ * files that were added or changed since it was written are read.
+ * Searches using the old index carry on undisturbed, since the new
+ * one replaces it with a rename. */
+int minigrep_build_index (char* path, char* file, int update)
+{
+    queue_t work_queue;
+    struct work_item* item;
+    struct index_builder* b;
+    struct index* old = NULL;
+    struct stat st, skip = { 0 };
+    unsigned char type;
+    unsigned int num_files = 0, num_read = 0;
+    char* real;
+    int ret;
+
+    if (update) {
+        old = index_open(file);
+        if (!old)
+            fprintf(stderr, "warning -- unable to read index %s (%s), rebuilding it\n",
+                    file, strerror(errno));
+        real = realpath(path, NULL);
+        if (old && (!real || strcmp(real, index_root(old)))) {
+            fprintf(stderr, "warning -- index %s was built for %s, rebuilding it\n",
+                    file, index_root(old));
+            index_close(old);
+            old = NULL;
+        }
+        free(real);
+    }
+
+    b = index_builder_new(path);
+    if (!b) {
+        fprintf(stderr, "error -- unable to start an index of %s\n", path);
+        index_close(old);
+        return -1;
+    }
+
+    if (queue_init(&work_queue, QUEUE_CAPACITY) < 0) {
+        fprintf(stderr, "error -- unable to allocate work queue\n");
+        index_builder_free(b);
+        index_close(old);
+        return -1;
+    }
+
+    stat(file, &skip);
+    item = work_item_new(NULL, path, strlen(path), DT_UNKNOWN);
+    if (item)
+        serial_post_work(&work_queue, item);
+
+    while ((item = serial_get_work(&work_queue)) != NULL) {
+        type = item->type;
+        if (type == DT_UNKNOWN) {
+            if (work_item_lstat(item, &st) < 0)
+                item_warning(stderr, "unable to stat", item);
+            else
+                type = IFTODT(st.st_mode);
+        }
+
+        if (type == DT_DIR) {
+            if (handle_directory(item, serial_post_work, &work_queue) < 0)
+                item_warning(stderr, "unable to decend into", item);
+        }
+        else if (type == WORK_CURSOR) {
+            if (handle_cursor(item, serial_post_work, &work_queue) < 0)
+                item_warning(stderr, "unable to decend into", item);
+        }
+        else if (type == DT_REG) {
+            ret = index_add_file(b, old, item, strlen(path), &skip);
+            if (ret >= 0)
+                num_files++;
+            if (ret > 0)
+                num_read++;
+        }
+        work_item_free(item);
+    }
+    queue_destroy(&work_queue);
+
+    /* the old index must stay mapped until its postings are copied */
+    ret = index_builder_write(b, file);
+    if (ret < 0)
+        fprintf(stderr, "error -- unable to write index %s: %s\n", file, strerror(errno));
+    else if (old)
+        printf("Indexed %u file(s) under \"%s\" into %s (%u read, %u unchanged).\n",
+               num_files, path, file, num_read, num_files - num_read);
+    else
+        printf("Indexed %u file(s) under \"%s\" into %s.\n", num_files, path, file);
+
+    index_builder_free(b);
+    index_close(old);
+
+    return ret;
+}
 
 int main(int argc, char** argv)
 {
     stopwatch_t T;
+    float seconds;
+    char* end;
+    unsigned long k;
+    long before = -1, after = -1;
+    int c, mode = 0, pattern_opts = 0;
+    char* path;
+
+    static const struct option long_options[] = {
+        { "sorted", no_argument, NULL, OPT_SORTED },
+        { "binary-files", required_argument, NULL, OPT_BINARY_FILES },
+        { "build-index", required_argument, NULL, OPT_BUILD_INDEX },
+        { "update-index", required_argument, NULL, OPT_UPDATE_INDEX },
+        { "index", required_argument, NULL, OPT_INDEX },
+        { "include", required_argument, NULL, OPT_INCLUDE },
+        { "exclude", required_argument, NULL, OPT_EXCLUDE },
+        { "exclude-dir", required_argument, NULL, OPT_EXCLUDE_DIR },
+        { "gitignore", no_argument, NULL, OPT_GITIGNORE },
+        { "file-times", no_argument, NULL, OPT_FILE_TIMES },
+        { "stats", no_argument, NULL, OPT_STATS },
+        { "queue-memory", required_argument, NULL, OPT_QUEUE_MEMORY },
+        { "max-count", required_argument, NULL, OPT_MAX_COUNT },
+        { "fuzzy", required_argument, NULL, OPT_FUZZY },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((c = getopt_long(argc, argv, "SPUIlcqEiwA:B:C:e:f:", long_options,
+                            NULL)) != -1) {
+        switch (c) {
+        case 'S':
+        case 'P':
+        case 'U':
+            mode = c;
+            break;
+        case OPT_SORTED:
+            opt.sorted = 1;
+            break;
+        case 'I':
+            opt.binary_files = BINARY_SKIP;
+            break;
+        case 'l':
+            opt.output = OUTPUT_FILES;
+            break;
+        case 'c':
+            opt.output = OUTPUT_COUNT;
+            break;
+        case 'q':
+            opt.output = OUTPUT_QUIET;
+            break;
+        case 'E':
+            opt.regex = 1;
+            break;
+        case 'i':
+            opt.icase = 1;
+            break;
+        case 'w':
+            opt.words = 1;
+            break;
+        case 'A':
+        case 'B':
+        case 'C':
+            errno = 0;
+            k = strtoul(optarg, &end, 10);
+            if (errno || end == optarg || *end || k > UINT_MAX) {
+                printf("error -- invalid number of lines \"%s\"\n\n", optarg);
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            opt.context = 1;
+            if (c == 'A')
+                after = k;
+            else if (c == 'B')
+                before = k;
+            else
+                opt.before = opt.after = k;
+            break;
+        case 'e':
+            pattern_opts = 1;
+            if (add_patterns(optarg, strlen(optarg)) < 0) {
+                fprintf(stderr, "error -- out of memory\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            pattern_opts = 1;
+            if (add_pattern_file(optarg) < 0) {
+                fprintf(stderr, "error -- unable to read patterns from %s: %s\n",
+                        optarg, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_BINARY_FILES:
+            if (!strcmp(optarg, "binary"))
+                opt.binary_files = BINARY_REPORT;
+            else if (!strcmp(optarg, "without-match"))
+                opt.binary_files = BINARY_SKIP;
+            else if (!strcmp(optarg, "text"))
+                opt.binary_files = BINARY_TEXT;
+            else {
+                printf("error -- unknown binary file type \"%s\"\n\n", optarg);
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_BUILD_INDEX:
+            opt.build_index = optarg;
+            break;
+        case OPT_UPDATE_INDEX:
+            opt.build_index = optarg;
+            opt.update_index = 1;
+            break;
+        case OPT_INDEX:
+            opt.index = optarg;
+            break;
+        case OPT_INCLUDE:
+        case OPT_EXCLUDE:
+        case OPT_EXCLUDE_DIR:
+            if (filter_add(c == OPT_INCLUDE ? FILTER_INCLUDE :
+                           c == OPT_EXCLUDE ? FILTER_EXCLUDE : FILTER_EXCLUDE_DIR,
+                           optarg) < 0) {
+                fprintf(stderr, "error -- out of memory\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_GITIGNORE:
+            filter_use_gitignore();
+            break;
+        case OPT_FILE_TIMES:
+            opt.file_times = 1;
+            break;
+        case OPT_MAX_COUNT:
+            errno = 0;
+            opt.max_count = strtoul(optarg, &end, 10);
+            if (errno || end == optarg || *end || !opt.max_count) {
+                printf("error -- invalid count \"%s\"\n\n", optarg);
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_FUZZY:
+            errno = 0;
+            k = strtoul(optarg, &end, 10);
+            if (errno || end == optarg || *end || k >= FUZZY_MAX_LEN) {
+                printf("error -- invalid number of edits \"%s\"\n\n", optarg);
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            opt.fuzzy = k;
+            break;
+        case OPT_QUEUE_MEMORY:
+            if (parse_size(optarg, &opt.queue_memory) < 0) {
+                printf("error -- invalid size \"%s\"\n\n", optarg);
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_STATS:
+            if (stats_enable() < 0)
+                fprintf(stderr, "warning -- built without --stats support\n");
+            else
+                opt.stats = 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
 
-    if(argc < 4){
+    /* -A and -B win over -C, whichever comes first */
+    if (before >= 0)
+        opt.before = before;
+    if (after >= 0)
+        opt.after = after;
+
+    if (argc - optind < (opt.build_index || pattern_opts ? 1 : 2)) {
         print_usage (argv[0]);
         return EXIT_FAILURE;
     }
-    string = argv[3];
+    if (pattern_opts && !num_patterns) {
+        printf("error -- no patterns given\n\n");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    /* a single path is searched, so anything more is a mistake (such as
+     * a string given along with -e or -f) rather than to be ignored */
+    if (argc - optind > (pattern_opts ? 1 : 2)) {
+        printf("error -- unexpected argument \"%s\"%s\n\n",
+               argv[optind + (pattern_opts ? 1 : 2)],
+               pattern_opts ? ": with -e or -f, path is the only one" : "");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    path = argv[optind];
+    string = num_patterns ? patterns[0] : argv[optind + 1];
+    if (setup_patterns(&string) < 0)
+        return EXIT_FAILURE;
+
+    /* pick the fastest substring search kernel this CPU supports */
+    search_init();
+    path_init();
+
+    if (opt.build_index) {
+        stopwatch_start(&T);
+        if (minigrep_build_index(path, opt.build_index, opt.update_index) < 0)
+            return EXIT_FAILURE;
+        printf("Index Build Execution Time: %f\n", stopwatch_report(&T));
+        return EXIT_SUCCESS;
+    }
 
-    if (!strcmp(argv[1], "-S")) {
+    /* no index to go by is no reason not to search */
+    if (opt.index)
+        index_search_open(path, string);
+
+    if (mode == 'S') {
         /* Perform a serial search of the file system */
         stopwatch_start(&T);
-        minigrep_simple(argv[2], string);
-        printf("Single Thread Execution Time: %f\n", stopwatch_report(&T));
+        minigrep_simple(path, string);
+        seconds = stopwatch_report(&T);
+        if (opt.output != OUTPUT_QUIET)
+            printf("Single Thread Execution Time: %f\n", seconds);
     }
-    else if (!strcmp(argv[1], "-P")) {
+    else if (mode == 'P') {
         /* Perform a multi-threaded search of the file system */
         stopwatch_start(&T);
-        minigrep_pthreads(argv[2], string);
-        printf("pthreads Execution Time: %f\n", stopwatch_report(&T));
+        minigrep_pthreads(path, string, 0);
+        seconds = stopwatch_report(&T);
+        if (opt.output != OUTPUT_QUIET)
+            printf("pthreads Execution Time: %f\n", seconds);
+    }
+    else if (mode == 'U') {
+        /* Perform a multi-threaded search with asynchronous file reads */
+        stopwatch_start(&T);
+        minigrep_pthreads(path, string, 1);
+        seconds = stopwatch_report(&T);
+        if (opt.output != OUTPUT_QUIET)
+            printf("io_uring Execution Time: %f\n", seconds);
     }
     else {
         printf("error -- invalide mode specified\n\n");
@@ -354,5 +3305,20 @@ int main(int argc, char** argv)
         return EXIT_FAILURE;
     }
 
+    if (search_index)
+        index_search_close();
+
+    /* every work item is gone by now */
+    slab_destroy();
+
+    if (opt.file_times)
+        file_times_report();
+    if (opt.stats)
+        stats_report(stderr, &stats_total, bytes_scanned, seconds);
+
+    /* like grep -q: the exit status is the answer */
+    if (opt.output == OUTPUT_QUIET && !num_occurences)
+        return EXIT_FAILURE;
+
     return EXIT_SUCCESS;
 }
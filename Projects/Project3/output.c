@@ -0,0 +1,283 @@
+/******************************************************************************
+ * output.c - per-thread output buffering and ordered merging for minigrep
+ *
+ * Workers never print directly.  Each one collects the output for the
+ * file it is scanning in its own outbuf and hands it over in one piece
+ * when the file is done: either straight to stdout with a single fwrite
+ * (so output from different files never interleaves), or, with --sorted,
+ * to the file's seq_node.  A file with more output than is worth holding
+ * on to is written out in pieces, but with stdout locked from the first
+ * piece to the last, so it still comes out whole.
+ *
+ * The seq_nodes form a tree mirroring the traversal: a directory's node
+ * lists its entries in the order they were read.  seq_merge walks that
+ * tree breadth first, which is exactly the order the FIFO work queue of
+ * -S visits the file system in, waiting for each node to complete before
+ * printing it.  Over the --queue-memory budget the traversal goes depth
+ * first instead, so -S then puts its output in order through a tree of
+ * its own, with seq_merge_step printing what is ready after each item.
+ * Either way, parallel output is byte-identical to -S.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "output.h"
+#include "slab.h"
+
+/* the node seq_merge is blocked on, if any */
+static struct seq_node* _Atomic merge_waiting_on;
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merge_signal = PTHREAD_COND_INITIALIZER;
+
+
+static int outbuf_reserve (struct outbuf* ob, size_t len)
+{
+    size_t size = ob->size ? ob->size : 4096;
+    char* data;
+
+    if (ob->len + len <= ob->size)
+        return 0;
+
+    while (size < ob->len + len)
+        size *= 2;
+
+    data = realloc(ob->data, size);
+    if (!data)
+        return -1;
+
+    ob->data = data;
+    ob->size = size;
+
+    return 0;
+}
+
+void outbuf_write (struct outbuf* ob, const char* data, size_t len)
+{
+    if (outbuf_reserve(ob, len) < 0) {
+        /* out of memory: get rid of what we have and write through */
+        outbuf_flush_early(ob);
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+
+    memcpy(ob->data + ob->len, data, len);
+    ob->len += len;
+}
+
+void outbuf_printf (struct outbuf* ob, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(ob->data + ob->len, ob->size - ob->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t)n < ob->size - ob->len) {
+        ob->len += n > 0 ? n : 0;
+        return;
+    }
+
+    if (outbuf_reserve(ob, n + 1) < 0)
+        return;
+
+    va_start(ap, fmt);
+    vsnprintf(ob->data + ob->len, ob->size - ob->len, fmt, ap);
+    va_end(ap);
+    ob->len += n;
+}
+
+/* Write out what has been collected so far of a file that isn't done
+ * yet.  stdout stays locked until the outbuf_flush that ends the file,
+ * so no other thread's output can get in between the pieces. */
+void outbuf_flush_early (struct outbuf* ob)
+{
+    if (!ob->locked) {
+        flockfile(stdout);
+        ob->locked = 1;
+    }
+
+    if (ob->len)
+        fwrite(ob->data, 1, ob->len, stdout);
+    ob->len = 0;
+}
+
+/* write out everything collected so far, ending the file */
+void outbuf_flush (struct outbuf* ob)
+{
+    if (ob->len)
+        fwrite(ob->data, 1, ob->len, stdout);
+    ob->len = 0;
+
+    if (ob->locked) {
+        funlockfile(stdout);
+        ob->locked = 0;
+    }
+}
+
+void outbuf_free (struct outbuf* ob)
+{
+    free(ob->data);
+    ob->data = NULL;
+    ob->len = 0;
+    ob->size = 0;
+}
+
+
+struct seq_node* seq_node_new (void)
+{
+    struct seq_node* node = slab_alloc(sizeof(*node));
+
+    if (node)
+        memset(node, 0, sizeof(*node));
+
+    return node;
+}
+
+/* Append a new child to a directory's node.  Only the thread listing
+ * the directory calls this, before completing the node.  Running out of
+ * memory here is fatal: an item without its node would have its output
+ * lost or printed out of order. */
+struct seq_node* seq_node_add_child (struct seq_node* parent)
+{
+    struct seq_node** children;
+    struct seq_node* child;
+    size_t max;
+
+    if (parent->num_children == parent->max_children) {
+        max = parent->max_children ? 2 * parent->max_children : 8;
+        children = realloc(parent->children, max * sizeof(*children));
+        if (!children)
+            goto oom;
+        parent->children = children;
+        parent->max_children = max;
+    }
+
+    child = seq_node_new();
+    if (!child)
+        goto oom;
+    parent->children[parent->num_children++] = child;
+
+    return child;
+
+oom:
+    fprintf(stderr, "error -- out of memory ordering output\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Mark a node complete, handing it the output collected in "ob" (which
+ * is left empty) */
+void seq_node_complete (struct seq_node* node, struct outbuf* ob)
+{
+    /* let go of stdout if running out of memory made us write to it */
+    if (ob->locked)
+        outbuf_flush(ob);
+
+    if (ob->len) {
+        node->out = ob->data;
+        node->out_len = ob->len;
+        ob->data = NULL;
+        ob->len = 0;
+        ob->size = 0;
+    }
+
+    atomic_store(&node->done, 1);
+    if (atomic_load(&merge_waiting_on) == node) {
+        pthread_mutex_lock(&merge_lock);
+        pthread_cond_signal(&merge_signal);
+        pthread_mutex_unlock(&merge_lock);
+    }
+}
+
+/* block until "node" has been completed by a worker */
+static void seq_node_wait (struct seq_node* node)
+{
+    if (atomic_load(&node->done))
+        return;
+
+    pthread_mutex_lock(&merge_lock);
+    atomic_store(&merge_waiting_on, node);
+    while (!atomic_load(&node->done))
+        pthread_cond_wait(&merge_signal, &merge_lock);
+    atomic_store(&merge_waiting_on, NULL);
+    pthread_mutex_unlock(&merge_lock);
+}
+
+/* Start merging the tree below "root" */
+void seq_merge_start (struct seq_merge* m, struct seq_node* root)
+{
+    memset(m, 0, sizeof(*m));
+    m->level = malloc(sizeof(*m->level));
+    if (!m->level) {
+        fprintf(stderr, "error -- out of memory merging output\n");
+        exit(EXIT_FAILURE);
+    }
+    m->level[0] = root;
+    m->num = 1;
+}
+
+/* Print the output of the nodes of the tree in breadth first order,
+ * freeing them as we go, for as long as the next one is complete (or,
+ * if "wait", until the whole tree is done).  Returns 1 once the whole
+ * tree has been printed, 0 if it stopped at a node still in progress. */
+int seq_merge_step (struct seq_merge* m, int wait)
+{
+    struct seq_node* node;
+    size_t j;
+
+    while (m->num) {
+        for (; m->pos < m->num; m->pos++) {
+            node = m->level[m->pos];
+            if (wait)
+                seq_node_wait(node);
+            else if (!atomic_load(&node->done))
+                return 0;
+
+            if (node->out_len)
+                fwrite(node->out, 1, node->out_len, stdout);
+
+            if (m->num_next + node->num_children > m->max_next) {
+                m->max_next = 2 * (m->num_next + node->num_children);
+                m->next = realloc(m->next, m->max_next * sizeof(*m->next));
+                if (!m->next) {
+                    fprintf(stderr, "error -- out of memory merging output\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            for (j = 0; j < node->num_children; j++)
+                m->next[m->num_next++] = node->children[j];
+
+            free(node->out);
+            free(node->children);
+            slab_free(node, sizeof(*node));
+        }
+
+        /* on to the next level down */
+        free(m->level);
+        m->level = m->next;
+        m->num = m->num_next;
+        m->pos = 0;
+        m->next = NULL;
+        m->num_next = 0;
+        m->max_next = 0;
+    }
+
+    free(m->level);
+    m->level = NULL;
+
+    return 1;
+}
+
+/* Print the output of every node below "root" in breadth first order,
+ * freeing the tree as we go.  Returns once the whole tree is done. */
+void seq_merge (struct seq_node* root)
+{
+    struct seq_merge m;
+
+    seq_merge_start(&m, root);
+    seq_merge_step(&m, 1);
+}
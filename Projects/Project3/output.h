@@ -0,0 +1,53 @@
+#ifndef _output_h_
+#define _output_h_
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* a growable buffer a thread collects one file's output in */
+struct outbuf {
+    char* data;
+    size_t len;
+    size_t size;
+    int locked;                 /* holding stdout, see outbuf_flush_early */
+};
+
+/* One work item's place in the traversal order (--sorted only).  The
+ * node is complete once its item has been processed: "out" then holds
+ * the item's output and, for a directory, "children" lists the nodes of
+ * its entries in the order they were read. */
+struct seq_node {
+    atomic_int done;
+    char* out;
+    size_t out_len;
+    struct seq_node** children;
+    size_t num_children;
+    size_t max_children;
+};
+
+/* how far seq_merge_step has got: the nodes of one level of the tree,
+ * the next of them to print and their children collected so far */
+struct seq_merge {
+    struct seq_node** level;
+    size_t num;
+    size_t pos;
+    struct seq_node** next;
+    size_t num_next;
+    size_t max_next;
+};
+
+void outbuf_write (struct outbuf* ob, const char* data, size_t len);
+void outbuf_printf (struct outbuf* ob, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void outbuf_flush_early (struct outbuf* ob);
+void outbuf_flush (struct outbuf* ob);
+void outbuf_free (struct outbuf* ob);
+
+struct seq_node* seq_node_new (void);
+struct seq_node* seq_node_add_child (struct seq_node* parent);
+void seq_node_complete (struct seq_node* node, struct outbuf* ob);
+void seq_merge_start (struct seq_merge* m, struct seq_node* root);
+int seq_merge_step (struct seq_merge* m, int wait);
+void seq_merge (struct seq_node* root);
+
+#endif /* _output_h_ */
@@ -0,0 +1,242 @@
+/******************************************************************************
+ * path.c - directory-relative naming of minigrep work items
+ *
+ * Work items don't carry a full path.  Each one names a file relative to
+ * its parent directory (a reference counted struct dir_ref) and every
+ * system call on it goes through openat/fstatat with the parent's open
+ * descriptor.  Full path strings are only put together when something
+ * has to be shown to the user, e.g. when a match is printed.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "path.h"
+#include "filter.h"
+#include "slab.h"
+
+/* directories we may hold open at once; the other half of the
+ * descriptor limit is left for the files being scanned */
+#define MAX_OPEN_DIRS 65536
+
+static unsigned int max_open_dirs = 256;
+static unsigned int max_open_fds = 512;
+static atomic_uint num_open_dirs;
+
+
+/* size the open directory budget from RLIMIT_NOFILE, raising the soft
+ * limit as far as we are allowed to first */
+void path_init (void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return;
+
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur / 2 > MAX_OPEN_DIRS) {
+        max_open_dirs = MAX_OPEN_DIRS;
+        max_open_fds = 2 * MAX_OPEN_DIRS;
+    }
+    else {
+        max_open_dirs = rl.rlim_cur / 2;
+        max_open_fds = rl.rlim_cur;
+    }
+}
+
+/* descriptors left over for open files once directories have had theirs */
+unsigned int path_spare_fds (void)
+{
+    return max_open_fds - max_open_dirs;
+}
+
+
+/* Build a work item for "name" (of length len) inside directory
+ * "parent", which may be NULL for the starting path.  "type" is the
+ * DT_* type reported by the directory listing, or DT_UNKNOWN. */
+struct work_item* work_item_new (struct dir_ref* parent, const char* name, size_t len,
+                                 unsigned char type)
+{
+    struct work_item* item;
+
+    item = slab_alloc(sizeof(*item) + len + 1);
+    if (!item)
+        return NULL;
+
+    item->next = NULL;
+    item->parent = parent;
+    item->seq = NULL;
+    item->chunk = NULL;
+    item->type = type;
+    item->len = len;
+    memcpy(item->name, name, len);
+    item->name[len] = '\0';
+
+    if (parent)
+        atomic_fetch_add(&parent->refs, 1);
+
+    return item;
+}
+
+void work_item_free (struct work_item* item)
+{
+    if (item->parent)
+        dir_ref_put(item->parent);
+    slab_free(item, sizeof(*item) + item->len + 1);
+}
+
+
+/* Put together the path of "name" below the directory "from", walking up
+ * through "parent" until we reach "base" (exclusive).  With a NULL base
+ * this is the full path as the user would know it.  Returns a string
+ * to be freed with path_free. */
+static char* build_path (const struct dir_ref* base, const struct dir_ref* parent,
+                         const char* name, size_t len)
+{
+    const struct dir_ref* ref;
+    size_t total = len;
+    char* path;
+    char* p;
+
+    for (ref = parent; ref != base; ref = ref->parent)
+        total += ref->len + 1;
+
+    path = slab_alloc(total + 1);
+    if (!path)
+        return NULL;
+
+    p = path + total;
+    *p = '\0';
+    p -= len;
+    memcpy(p, name, len);
+    for (ref = parent; ref != base; ref = ref->parent) {
+        *--p = '/';
+        p -= ref->len;
+        memcpy(p, ref->name, ref->len);
+    }
+
+    return path;
+}
+
+/* full path of a work item (free it with path_free) */
+char* work_item_path (struct work_item* item)
+{
+    return build_path(NULL, item->parent, item->name, item->len);
+}
+
+void path_free (char* path)
+{
+    if (path)
+        slab_free(path, strlen(path) + 1);
+}
+
+/* Find the directory descriptor to resolve "item" against and the name
+ * to hand it.  Normally that is the parent's descriptor and the item's
+ * own name; if the parent had to be closed, it is the nearest open
+ * ancestor (or the cwd) and a relative path built up to it, which the
+ * caller must path_free if it differs from item->name. */
+int work_item_resolve (struct work_item* item, const char** name)
+{
+    const struct dir_ref* base = item->parent;
+
+    while (base && base->fd < 0)
+        base = base->parent;
+
+    if (base == item->parent)
+        *name = item->name;
+    else
+        *name = build_path(base, item->parent, item->name, item->len);
+
+    return base ? base->fd : AT_FDCWD;
+}
+
+int work_item_open (struct work_item* item, int flags)
+{
+    const char* name;
+    int dirfd, fd;
+
+    dirfd = work_item_resolve(item, &name);
+    if (!name)
+        return -1;
+
+    fd = openat(dirfd, name, flags | O_CLOEXEC);
+    if (name != item->name)
+        path_free((char*)name);
+
+    return fd;
+}
+
+int work_item_lstat (struct work_item* item, struct stat* st)
+{
+    const char* name;
+    int dirfd, ret;
+
+    dirfd = work_item_resolve(item, &name);
+    if (!name)
+        return -1;
+
+    ret = fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+    if (name != item->name)
+        path_free((char*)name);
+
+    return ret;
+}
+
+
+/* Turn the directory work item "item", opened as "fd", into a directory
+ * reference for its children.  The reference keeps "fd" if the open
+ * directory budget allows it; otherwise its fd is -1 and the caller
+ * remains responsible for closing "fd" once it has been listed.  The
+ * caller holds the one reference returned. */
+struct dir_ref* dir_ref_new (struct work_item* item, int fd)
+{
+    struct dir_ref* ref;
+
+    ref = slab_alloc(sizeof(*ref) + item->len + 1);
+    if (!ref)
+        return NULL;
+
+    atomic_init(&ref->refs, 1);
+    ref->parent = item->parent;
+    ref->ignore = NULL;
+    ref->len = item->len;
+    memcpy(ref->name, item->name, item->len + 1);
+
+    if (ref->parent)
+        atomic_fetch_add(&ref->parent->refs, 1);
+
+    if (atomic_fetch_add(&num_open_dirs, 1) < max_open_dirs)
+        ref->fd = fd;
+    else {
+        atomic_fetch_sub(&num_open_dirs, 1);
+        ref->fd = -1;
+    }
+
+    return ref;
+}
+
+/* Drop a reference.  The last one out closes the directory and drops
+ * the reference it holds on its own parent. */
+void dir_ref_put (struct dir_ref* ref)
+{
+    struct dir_ref* parent;
+
+    while (ref && atomic_fetch_sub(&ref->refs, 1) == 1) {
+        parent = ref->parent;
+        if (ref->fd >= 0) {
+            close(ref->fd);
+            atomic_fetch_sub(&num_open_dirs, 1);
+        }
+        ignore_free(ref->ignore);
+        slab_free(ref, sizeof(*ref) + ref->len + 1);
+        ref = parent;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef _path_h_
+#define _path_h_
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "queue.h"
+
+/* A directory that has been listed and still has work items pending
+ * beneath it.  While the number of open directories stays within the
+ * descriptor budget the directory is kept open, and its children are
+ * opened and stat'ed relative to "fd" so the kernel never re-resolves
+ * the full path.  Past the budget "fd" is -1 and children are reached
+ * through the path below the nearest ancestor that is still open. */
+struct dir_ref {
+    atomic_uint refs;
+    int fd;
+    struct dir_ref* parent;
+    struct ignore* ignore;      /* its .gitignore rules, if any */
+    size_t len;                 /* strlen(name) */
+    char name[];                /* relative to parent (or as given) */
+};
+
+void path_init (void);
+unsigned int path_spare_fds (void);
+
+struct work_item* work_item_new (struct dir_ref* parent, const char* name, size_t len,
+                                 unsigned char type);
+void work_item_free (struct work_item* item);
+
+int work_item_resolve (struct work_item* item, const char** name);
+int work_item_open (struct work_item* item, int flags);
+int work_item_lstat (struct work_item* item, struct stat* st);
+char* work_item_path (struct work_item* item);
+void path_free (char* path);
+
+struct dir_ref* dir_ref_new (struct work_item* item, int fd);
+void dir_ref_put (struct dir_ref* ref);
+
+#endif /* _path_h_ */
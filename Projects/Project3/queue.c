@@ -0,0 +1,220 @@
+/******************************************************************************
+ * queue.c - work queue shared by the minigrep search engines
+ *
+ * The ring follows Dmitry Vyukov's bounded MPMC design: every slot carries
+ * a sequence number that tells producers and consumers whether the slot
+ * is free for the lap they are on, so both push and pop are a single CAS
+ * on the tail/head counter plus one release store.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "queue.h"
+#include "path.h"
+
+/* capacity is rounded up to a power of 2 */
+int queue_init (queue_t* q, size_t capacity)
+{
+    size_t i, size = 2;
+
+    while (size < capacity)
+        size <<= 1;
+
+    q->slots = malloc(size * sizeof(*q->slots));
+    if (!q->slots)
+        return -1;
+
+    for (i = 0; i < size; i++)
+        atomic_init(&q->slots[i].seq, i);
+
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->spill_count, 0);
+    pthread_mutex_init(&q->spill_lock, NULL);
+    q->spill_head = NULL;
+    q->spill_tail = NULL;
+    atomic_init(&q->front_count, 0);
+    q->front = NULL;
+
+    return 0;
+}
+
+/* frees the queue along with any items still in it */
+void queue_destroy (queue_t* q)
+{
+    struct work_item* item;
+
+    while ((item = dequeue(q)) != NULL)
+        work_item_free(item);
+
+    free(q->slots);
+    pthread_mutex_destroy(&q->spill_lock);
+}
+
+
+/* lock-free fast path: returns -1 if the ring is full */
+static int ring_push (queue_t* q, struct work_item* item)
+{
+    struct queue_slot* slot;
+    size_t seq, pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    intptr_t diff;
+
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return -1;
+        else
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+
+    slot->item = item;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    return 0;
+}
+
+/* lock-free fast path: returns NULL if the ring is empty */
+static struct work_item* ring_pop (queue_t* q)
+{
+    struct queue_slot* slot;
+    struct work_item* item;
+    size_t seq, pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    intptr_t diff;
+
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return NULL;
+        else
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+
+    item = slot->item;
+    atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+
+    return item;
+}
+
+
+/* park an item at the end of the spill list */
+static void spill_push (queue_t* q, struct work_item* item)
+{
+    item->next = NULL;
+
+    pthread_mutex_lock(&q->spill_lock);
+    if (q->spill_tail)
+        q->spill_tail->next = item;
+    else
+        q->spill_head = item;
+    q->spill_tail = item;
+    atomic_fetch_add(&q->spill_count, 1);
+    pthread_mutex_unlock(&q->spill_lock);
+}
+
+/* called when the ring has run dry: hand back the oldest spilled item
+ * and move as many of the rest as will fit back into the ring */
+static struct work_item* spill_refill (queue_t* q)
+{
+    struct work_item* item;
+    struct work_item* next;
+
+    pthread_mutex_lock(&q->spill_lock);
+    item = q->spill_head;
+    if (item) {
+        q->spill_head = item->next;
+        atomic_fetch_sub(&q->spill_count, 1);
+
+        while (q->spill_head) {
+            next = q->spill_head->next;
+            if (ring_push(q, q->spill_head) < 0)
+                break;
+            q->spill_head = next;
+            atomic_fetch_sub(&q->spill_count, 1);
+        }
+        if (!q->spill_head)
+            q->spill_tail = NULL;
+    }
+    pthread_mutex_unlock(&q->spill_lock);
+
+    return item;
+}
+
+
+/* adds an item to the tail of the queue.  once anything has spilled,
+ * new items follow it onto the spill list to preserve FIFO order */
+void enqueue (queue_t* q, struct work_item* item)
+{
+    if (atomic_load(&q->spill_count) || ring_push(q, item) < 0)
+        spill_push(q, item);
+}
+
+/* adds an item that is to be taken before anything else in the queue,
+ * including the items pushed to the front before it */
+void queue_push_front (queue_t* q, struct work_item* item)
+{
+    pthread_mutex_lock(&q->spill_lock);
+    item->next = q->front;
+    q->front = item;
+    atomic_fetch_add(&q->front_count, 1);
+    pthread_mutex_unlock(&q->spill_lock);
+}
+
+static struct work_item* front_pop (queue_t* q)
+{
+    struct work_item* item;
+
+    pthread_mutex_lock(&q->spill_lock);
+    item = q->front;
+    if (item) {
+        q->front = item->next;
+        atomic_fetch_sub(&q->front_count, 1);
+    }
+    pthread_mutex_unlock(&q->spill_lock);
+
+    return item;
+}
+
+/* removes the most recent item pushed to the front or, failing that,
+ * the oldest item in the queue.  returns NULL if the queue is empty */
+struct work_item* dequeue (queue_t* q)
+{
+    struct work_item* item;
+
+    if (atomic_load(&q->front_count) && (item = front_pop(q)) != NULL)
+        return item;
+
+    item = ring_pop(q);
+    if (!item && atomic_load(&q->spill_count))
+        item = spill_refill(q);
+
+    return item;
+}
+
+/* number of items in the queue; only a snapshot while others are
+ * pushing and popping */
+size_t queue_length (queue_t* q)
+{
+    size_t head = atomic_load(&q->head);
+    size_t tail = atomic_load(&q->tail);
+
+    return (tail > head ? tail - head : 0) + atomic_load(&q->spill_count)
+           + atomic_load(&q->front_count);
+}
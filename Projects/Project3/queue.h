@@ -0,0 +1,65 @@
+#ifndef _queue_h_
+#define _queue_h_
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define CACHE_LINE 64
+
+struct dir_ref;
+struct seq_node;
+struct chunk;
+
+/* a pending work item.  the name is relative to the parent directory,
+ * stored inline and the allocation is sized to fit it, so a queued entry
+ * costs a few dozen bytes rather than PATH_MAX */
+struct work_item {
+    struct work_item* next;   /* link while parked on the spill list */
+    struct dir_ref* parent;   /* NULL for the starting path */
+    struct seq_node* seq;     /* place in the output order (--sorted) */
+    struct chunk* chunk;      /* piece of a split file to scan, if any */
+    unsigned char type;       /* DT_* from the directory listing */
+    size_t len;               /* strlen(name) */
+    char name[];
+};
+
+struct queue_slot {
+    atomic_size_t seq;
+    struct work_item* item;
+};
+
+/* Bounded lock-free multi-producer/multi-consumer FIFO (a ring of
+ * sequence-numbered slots).  Pushes that find the ring full are parked
+ * on a mutex-protected spill list and moved back into the ring as it
+ * drains, so the queue never rejects work and stays FIFO.  Items pushed
+ * with queue_push_front go on a LIFO stack (under the same lock) that
+ * is emptied before the FIFO, for depth first traversal. */
+typedef struct {
+    struct queue_slot* slots;
+    size_t mask;
+    char pad0[CACHE_LINE];
+
+    atomic_size_t head;       /* next position to pop */
+    char pad1[CACHE_LINE];
+
+    atomic_size_t tail;       /* next position to push */
+    char pad2[CACHE_LINE];
+
+    atomic_size_t spill_count;
+    pthread_mutex_t spill_lock;
+    struct work_item* spill_head;
+    struct work_item* spill_tail;
+
+    atomic_size_t front_count;
+    struct work_item* front;
+} queue_t;
+
+int queue_init (queue_t* q, size_t capacity);
+void queue_destroy (queue_t* q);
+void enqueue (queue_t* q, struct work_item* item);
+void queue_push_front (queue_t* q, struct work_item* item);
+struct work_item* dequeue (queue_t* q);
+size_t queue_length (queue_t* q);
+
+#endif /* _queue_h_ */
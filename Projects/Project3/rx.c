@@ -0,0 +1,1338 @@
+/******************************************************************************
+ * rx.c - extended regular expressions (-E) run as a lazily built DFA
+ *
+ * A pattern is parsed into a syntax tree and compiled into a Thompson
+ * NFA, which is never run directly.  Instead each searching thread
+ * builds the DFA for it on demand: a DFA state is the set of NFA states
+ * live at some point in a line, and the transition out of it on a
+ * given byte is worked out (and remembered) the first time the search
+ * needs it.  Every byte therefore costs one table lookup no matter how
+ * the pattern is written, with no backtracking to blow up.  If a
+ * pathological pattern makes a thread build too many states, its DFA
+ * is thrown away and built again from where the search is.
+ *
+ * The search only has to decide whether a line matches, so the DFA is
+ * unanchored (a match may begin at any byte), stops at the first byte
+ * that completes a match and starts again at every newline.  Bytes that
+ * the pattern can't tell apart share a column of the transition table.
+ *
+ * The longest string that every match has to contain is worked out
+ * from the syntax tree, so the caller can skip ahead with the substring
+ * search to the lines holding it and only run the DFA over those.
+ *
+ * Supported: literals, ".", bracket expressions with ranges, negation
+ * and [:class:] names, "^", "$", grouping, "|", "*", "+", "?", {m},
+ * {m,}, {m,n} (and {,n}), and the \d \D \w \W \s \S shorthands.  Bytes
+ * are matched one at a time, so "." steps over a single byte of a
+ * multibyte character.  The same machinery serves fixed strings that
+ * need more than the substring search can do: RX_ICASE on a pattern
+ * with letters beyond ASCII, whose other case can be a different
+ * number of bytes, and RX_WORDS.
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <locale.h>
+#include <wctype.h>
+
+#include "rx.h"
+#include "search.h"
+
+#define RX_DUP_MAX 255              /* largest count in {m,n} */
+#define RX_MAX_NODES 100000         /* largest NFA we are willing to run */
+#define RX_LITERAL_MAX 256
+#define RX_DFA_MEMORY (2 << 20)     /* transition table budget per thread */
+
+#define RX_UNKNOWN (-1)             /* transition not worked out yet */
+#define RX_MATCH (-2)               /* transition completes a match */
+
+struct byte_set {
+    uint64_t bits[4];
+};
+
+enum ast_type {
+    AST_EMPTY,
+    AST_SET,                    /* one byte out of a set */
+    AST_CAT,
+    AST_ALT,
+    AST_REPEAT,
+    AST_BOL,                    /* ^ */
+    AST_EOL                     /* $ */
+};
+
+struct ast {
+    int type;
+    int a, b;                   /* operands of CAT and ALT, REPEAT's is a */
+    int min, max;               /* REPEAT; max < 0 for no limit */
+    uint32_t set;               /* SET */
+};
+
+enum nfa_type {
+    NFA_SET,
+    NFA_SPLIT,
+    NFA_BOL,
+    NFA_EOL,
+    NFA_MATCH
+};
+
+struct nfa_node {
+    int type;
+    uint32_t set;               /* NFA_SET */
+    uint32_t out;
+    uint32_t out1;              /* NFA_SPLIT */
+};
+
+struct rx {
+    struct nfa_node* nodes;
+    size_t num_nodes;
+    uint32_t start;
+    struct byte_set* sets;
+    uint8_t classes[256];       /* byte -> column of the DFA table */
+    uint8_t class_byte[256];    /* some byte of each class */
+    size_t num_classes;
+    unsigned int nl_class;
+    char literal[RX_LITERAL_MAX + 1];
+    size_t literal_len;
+    int exact;                  /* the pattern is just the literal */
+    size_t max_len;
+};
+
+struct rx_dfa {
+    const struct rx* rx;
+    size_t num_classes;
+    int32_t* trans;             /* [row + class]: the next state's row */
+    uint8_t* eol_match;         /* would "$" complete a match here? */
+    uint8_t* bol;               /* the state is at the start of a line */
+    uint32_t* set_off;          /* a state's NFA states are */
+    uint32_t* set_len;          /*   pool[set_off .. set_off + set_len) */
+    uint32_t* hashes;
+    size_t num_states;
+    size_t max_states;
+    uint32_t* pool;
+    size_t pool_len;
+    size_t pool_max;
+    int32_t* table;             /* hash table of the states */
+    size_t table_mask;
+    int32_t line_start;         /* < 0 until it has been built */
+    unsigned int generation;    /* bumped whenever the DFA is thrown away */
+    int every_line;             /* the empty string matches */
+
+    /* scratch space for working out a state */
+    uint32_t* list;
+    uint32_t* stack;
+    uint32_t* mark;
+    uint32_t stamp;
+};
+
+
+/***** PARSING ***************************************/
+struct parser {
+    const char* p;
+    const char* error;
+    int depth;
+    struct ast* ast;
+    size_t num_ast;
+    size_t max_ast;
+    struct byte_set* sets;
+    size_t num_sets;
+    size_t max_sets;
+    int flags;                  /* RX_* */
+    locale_t locale;            /* for the case of characters beyond ASCII */
+};
+
+static inline void set_add (struct byte_set* s, unsigned int c)
+{
+    s->bits[c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline int set_has (const struct byte_set* s, unsigned int c)
+{
+    return s->bits[c >> 6] >> (c & 63) & 1;
+}
+
+static int new_ast (struct parser* ps, int type, int a, int b)
+{
+    struct ast* tmp;
+    size_t max;
+
+    if (ps->num_ast == ps->max_ast) {
+        max = ps->max_ast ? 2 * ps->max_ast : 64;
+        tmp = realloc(ps->ast, max * sizeof(*tmp));
+        if (!tmp) {
+            ps->error = "out of memory";
+            return -1;
+        }
+        ps->ast = tmp;
+        ps->max_ast = max;
+    }
+
+    memset(&ps->ast[ps->num_ast], 0, sizeof(*ps->ast));
+    ps->ast[ps->num_ast].type = type;
+    ps->ast[ps->num_ast].a = a;
+    ps->ast[ps->num_ast].b = b;
+
+    return ps->num_ast++;
+}
+
+/* A SET node for an empty set; fill in ps->sets[ps->ast[n].set] */
+static int new_set (struct parser* ps)
+{
+    struct byte_set* tmp;
+    size_t max;
+    int n;
+
+    if (ps->num_sets == ps->max_sets) {
+        max = ps->max_sets ? 2 * ps->max_sets : 16;
+        tmp = realloc(ps->sets, max * sizeof(*tmp));
+        if (!tmp) {
+            ps->error = "out of memory";
+            return -1;
+        }
+        ps->sets = tmp;
+        ps->max_sets = max;
+    }
+
+    n = new_ast(ps, AST_SET, -1, -1);
+    if (n < 0)
+        return -1;
+    memset(&ps->sets[ps->num_sets], 0, sizeof(*ps->sets));
+    ps->ast[n].set = ps->num_sets++;
+
+    return n;
+}
+
+static int new_byte (struct parser* ps, unsigned char c)
+{
+    int n = new_set(ps);
+
+    if (n >= 0)
+        set_add(&ps->sets[ps->ast[n].set], c);
+    return n;
+}
+
+/* Decode the UTF-8 character at "p".  Returns its length, 0 if "p"
+ * doesn't start a valid multibyte character. */
+static int utf8_decode (const unsigned char* p, uint32_t* cp)
+{
+    int len, i;
+
+    if (*p >= 0xc2 && *p <= 0xdf) {
+        len = 2;
+        *cp = *p & 0x1f;
+    }
+    else if (*p >= 0xe0 && *p <= 0xef) {
+        len = 3;
+        *cp = *p & 0x0f;
+    }
+    else if (*p >= 0xf0 && *p <= 0xf4) {
+        len = 4;
+        *cp = *p & 0x07;
+    }
+    else
+        return 0;
+
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+        *cp = *cp << 6 | (p[i] & 0x3f);
+    }
+
+    return len;
+}
+
+static int utf8_encode (uint32_t cp, unsigned char* out)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xc0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3f);
+    out[2] = 0x80 | (cp >> 6 & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/* the bytes of code point "cp" in a row */
+static int new_utf8 (struct parser* ps, uint32_t cp)
+{
+    unsigned char buf[4];
+    int len, i, n = -1, b;
+
+    len = utf8_encode(cp, buf);
+    for (i = 0; i < len; i++) {
+        b = new_byte(ps, buf[i]);
+        if (b < 0)
+            return -1;
+        n = i ? new_ast(ps, AST_CAT, n, b) : b;
+        if (n < 0)
+            return -1;
+    }
+
+    return n;
+}
+
+/* The literal character at ps->p, which is consumed.  With RX_ICASE it
+ * matches the character's other case too: for an ASCII letter both are
+ * put in one set, for a letter beyond ASCII (the slow path) each case's
+ * UTF-8 encoding becomes an alternative. */
+static int new_char (struct parser* ps)
+{
+    const unsigned char* p = (const unsigned char*)ps->p;
+    uint32_t cp, variants[5];
+    int len, num = 0, i, j, n = -1, v;
+
+    if (!(ps->flags & RX_ICASE) || (*p >= 0x80 && !ps->locale)) {
+        ps->p++;
+        return new_byte(ps, *p);
+    }
+
+    if (*p < 0x80) {
+        ps->p++;
+        n = new_byte(ps, *p);
+        if (n >= 0 && (*p | 0x20) - 'a' < 26u)
+            set_add(&ps->sets[ps->ast[n].set], *p ^ 0x20);
+        return n;
+    }
+
+    len = utf8_decode(p, &cp);
+    if (!len) {
+        ps->p++;
+        return new_byte(ps, *p);
+    }
+    ps->p += len;
+
+    variants[0] = cp;
+    variants[1] = towlower_l(cp, ps->locale);
+    variants[2] = towupper_l(cp, ps->locale);
+    variants[3] = towlower_l(variants[2], ps->locale);
+    variants[4] = towupper_l(variants[1], ps->locale);
+    for (i = 0; i < 5; i++) {
+        for (j = 0; j < num && variants[j] != variants[i]; j++)
+            ;
+        if (j < num)
+            continue;
+        variants[num++] = variants[i];
+
+        v = new_utf8(ps, variants[i]);
+        if (v < 0)
+            return -1;
+        n = n < 0 ? v : new_ast(ps, AST_ALT, n, v);
+        if (n < 0)
+            return -1;
+    }
+
+    return n;
+}
+
+/* Add the bytes of the [:name:] class at "name" to "s" */
+static int add_class (struct byte_set* s, const char* name, size_t len)
+{
+    static const struct {
+        const char* name;
+        int (*is)(int);
+    } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+        { "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+        { "lower", islower }, { "print", isprint }, { "punct", ispunct },
+        { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit }
+    };
+    size_t i;
+    int c;
+
+    for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if (strlen(classes[i].name) != len || strncmp(classes[i].name, name, len))
+            continue;
+        for (c = 0; c < 128; c++)
+            if (classes[i].is(c))
+                set_add(s, c);
+        return 0;
+    }
+
+    return -1;
+}
+
+/* \d \w \s and their complements; returns -1 if "c" isn't one */
+static int add_shorthand (struct byte_set* s, char c)
+{
+    struct byte_set tmp = { { 0 } };
+    int i;
+
+    switch (c) {
+    case 'd':
+    case 'D':
+        add_class(&tmp, "digit", 5);
+        break;
+    case 'w':
+    case 'W':
+        add_class(&tmp, "alnum", 5);
+        set_add(&tmp, '_');
+        break;
+    case 's':
+    case 'S':
+        add_class(&tmp, "space", 5);
+        break;
+    default:
+        return -1;
+    }
+
+    if (isupper((unsigned char)c)) {
+        for (i = 0; i < 4; i++)
+            tmp.bits[i] = ~tmp.bits[i];
+        tmp.bits['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+    }
+    for (i = 0; i < 4; i++)
+        s->bits[i] |= tmp.bits[i];
+
+    return 0;
+}
+
+static int parse_bracket (struct parser* ps)
+{
+    const unsigned char* p = (const unsigned char*)ps->p + 1;
+    const char* close;
+    struct byte_set* s;
+    unsigned int lo, hi, c;
+    int n, negate = 0, first = 1, i;
+
+    n = new_set(ps);
+    if (n < 0)
+        return -1;
+    s = &ps->sets[ps->ast[n].set];
+
+    if (*p == '^') {
+        negate = 1;
+        p++;
+    }
+
+    while (1) {
+        if (!*p) {
+            ps->error = "unmatched [";
+            return -1;
+        }
+        if (*p == ']' && !first)
+            break;
+        first = 0;
+
+        if (p[0] == '[' && p[1] == ':') {
+            close = strstr((const char*)p + 2, ":]");
+            if (!close
+                    || add_class(s, (const char*)p + 2, close - (const char*)p - 2) < 0) {
+                ps->error = "unknown character class";
+                return -1;
+            }
+            p = (const unsigned char*)close + 2;
+            continue;
+        }
+
+        lo = hi = *p++;
+        if (p[0] == '-' && p[1] && p[1] != ']') {
+            hi = p[1];
+            p += 2;
+            if (hi < lo) {
+                ps->error = "invalid range";
+                return -1;
+            }
+        }
+        for (c = lo; c <= hi; c++)
+            set_add(s, c);
+    }
+    ps->p = (const char*)p + 1;
+
+    if (ps->flags & RX_ICASE) {
+        for (c = 'a'; c <= 'z'; c++) {
+            if (set_has(s, c) || set_has(s, c ^ 0x20)) {
+                set_add(s, c);
+                set_add(s, c ^ 0x20);
+            }
+        }
+    }
+
+    /* a negated set still never matches the end of the line */
+    if (negate) {
+        for (i = 0; i < 4; i++)
+            s->bits[i] = ~s->bits[i];
+        s->bits['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+    }
+
+    return n;
+}
+
+/* Parse {m}, {m,}, {,n} or {m,n} at ps->p.  Returns 0 if it isn't a
+ * bound at all (so the brace is a literal). */
+static int parse_bound (struct parser* ps, int* min, int* max)
+{
+    const char* p = ps->p + 1;
+    long lo = 0, hi;
+
+    if (!isdigit((unsigned char)*p) && *p != ',')
+        return 0;
+    while (isdigit((unsigned char)*p) && lo <= RX_DUP_MAX)
+        lo = lo * 10 + *p++ - '0';
+    hi = lo;
+    if (*p == ',') {
+        p++;
+        hi = -1;
+        if (isdigit((unsigned char)*p)) {
+            hi = 0;
+            while (isdigit((unsigned char)*p) && hi <= RX_DUP_MAX)
+                hi = hi * 10 + *p++ - '0';
+        }
+    }
+    if (*p != '}')
+        return 0;
+
+    if (lo > RX_DUP_MAX || hi > RX_DUP_MAX || (hi >= 0 && hi < lo)) {
+        ps->error = "invalid repetition count";
+        return -1;
+    }
+
+    ps->p = p + 1;
+    *min = lo;
+    *max = hi;
+    return 1;
+}
+
+static int parse_alt (struct parser* ps);
+
+static int parse_atom (struct parser* ps)
+{
+    unsigned char c = *ps->p;
+    int n, i;
+
+    switch (c) {
+    case '(':
+        if (++ps->depth > 1000) {
+            ps->error = "parentheses nested too deeply";
+            return -1;
+        }
+        ps->p++;
+        n = parse_alt(ps);
+        if (n < 0)
+            return -1;
+        if (*ps->p != ')') {
+            ps->error = "unmatched (";
+            return -1;
+        }
+        ps->p++;
+        ps->depth--;
+        return n;
+    case '[':
+        return parse_bracket(ps);
+    case '.':
+        ps->p++;
+        n = new_set(ps);
+        if (n >= 0) {
+            for (i = 0; i < 4; i++)
+                ps->sets[ps->ast[n].set].bits[i] = ~0ULL;
+            ps->sets[ps->ast[n].set].bits['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+        }
+        return n;
+    case '^':
+        ps->p++;
+        return new_ast(ps, AST_BOL, -1, -1);
+    case '$':
+        ps->p++;
+        return new_ast(ps, AST_EOL, -1, -1);
+    case '*':
+    case '+':
+    case '?':
+        ps->error = "nothing to repeat";
+        return -1;
+    case '\\':
+        c = ps->p[1];
+        if (!c) {
+            ps->error = "trailing backslash";
+            return -1;
+        }
+        if (c >= '1' && c <= '9') {
+            ps->error = "back-references are not supported";
+            return -1;
+        }
+        if (strchr("bB<>`'", c)) {
+            ps->error = "word boundaries are not supported (use -w)";
+            return -1;
+        }
+        ps->p++;
+        if (strchr("dDwWsS", c)) {
+            ps->p++;
+            n = new_set(ps);
+            if (n >= 0)
+                add_shorthand(&ps->sets[ps->ast[n].set], c);
+            return n;
+        }
+        return new_char(ps);
+    default:
+        /* including a ")" with no "(" and a "{" that isn't a bound */
+        return new_char(ps);
+    }
+}
+
+static int parse_repeat (struct parser* ps)
+{
+    int n, min, max, ret;
+
+    n = parse_atom(ps);
+    while (n >= 0) {
+        switch (*ps->p) {
+        case '*':
+            min = 0;
+            max = -1;
+            ps->p++;
+            break;
+        case '+':
+            min = 1;
+            max = -1;
+            ps->p++;
+            break;
+        case '?':
+            min = 0;
+            max = 1;
+            ps->p++;
+            break;
+        case '{':
+            ret = parse_bound(ps, &min, &max);
+            if (ret <= 0)
+                return ret < 0 ? -1 : n;
+            break;
+        default:
+            return n;
+        }
+
+        n = new_ast(ps, AST_REPEAT, n, -1);
+        if (n >= 0) {
+            ps->ast[n].min = min;
+            ps->ast[n].max = max;
+        }
+    }
+
+    return n;
+}
+
+static int parse_cat (struct parser* ps)
+{
+    int n, r;
+
+    n = new_ast(ps, AST_EMPTY, -1, -1);
+    while (n >= 0 && *ps->p && *ps->p != '|' && (*ps->p != ')' || !ps->depth)) {
+        r = parse_repeat(ps);
+        if (r < 0)
+            return -1;
+        n = ps->ast[n].type == AST_EMPTY ? r : new_ast(ps, AST_CAT, n, r);
+    }
+
+    return n;
+}
+
+static int parse_alt (struct parser* ps)
+{
+    int n, r;
+
+    n = parse_cat(ps);
+    while (n >= 0 && *ps->p == '|') {
+        ps->p++;
+        r = parse_cat(ps);
+        if (r < 0)
+            return -1;
+        n = new_ast(ps, AST_ALT, n, r);
+    }
+
+    return n;
+}
+
+/* RX_LITERAL: the whole pattern is a string to match as it stands */
+static int parse_literal (struct parser* ps)
+{
+    int n, r;
+
+    n = new_ast(ps, AST_EMPTY, -1, -1);
+    while (n >= 0 && *ps->p) {
+        r = new_char(ps);
+        if (r < 0)
+            return -1;
+        n = ps->ast[n].type == AST_EMPTY ? r : new_ast(ps, AST_CAT, n, r);
+    }
+
+    return n;
+}
+
+/* RX_WORDS: (^|\W)n(\W|$), where \W is anything that isn't a word
+ * constituent.  As only whole lines are reported, that is as good as a
+ * real word boundary. */
+static int word_bounded (struct parser* ps, int n)
+{
+    struct byte_set* s;
+    int other, bol, eol, before, after;
+    unsigned int c;
+
+    other = new_set(ps);
+    if (other < 0)
+        return -1;
+    s = &ps->sets[ps->ast[other].set];
+    for (c = 0; c < 256; c++)
+        if (!search_is_word(c) && c != '\n')
+            set_add(s, c);
+
+    bol = new_ast(ps, AST_BOL, -1, -1);
+    eol = new_ast(ps, AST_EOL, -1, -1);
+    before = bol < 0 ? -1 : new_ast(ps, AST_ALT, bol, other);
+    after = eol < 0 || before < 0 ? -1 : new_ast(ps, AST_ALT, other, eol);
+    n = after < 0 ? -1 : new_ast(ps, AST_CAT, before, n);
+
+    return n < 0 ? -1 : new_ast(ps, AST_CAT, n, after);
+}
+/***************************/
+
+
+/***** ANALYSIS **************************************/
+/* The byte a SET node matches if it matches just the one, else -1.
+ * With RX_ICASE a letter in either case counts, as its lower case. */
+static int single_byte (const struct parser* ps, const struct ast* a)
+{
+    const struct byte_set* s = &ps->sets[a->set];
+    int i, c = -1, count = 0;
+
+    if (a->type != AST_SET)
+        return -1;
+    for (i = 0; i < 4; i++)
+        count += __builtin_popcountll(s->bits[i]);
+    for (i = 3; i >= 0; i--)
+        if (s->bits[i])
+            c = i * 64 + __builtin_ctzll(s->bits[i]);
+
+    if (count == 1)
+        return c;
+    if (count == 2 && ps->flags & RX_ICASE && c - 'A' < 26u && set_has(s, c | 0x20))
+        return c | 0x20;
+
+    return -1;
+}
+
+/* collect the factors of a (left-leaning) chain of CATs */
+static void flatten (const struct parser* ps, int n, int* out, size_t* num)
+{
+    if (ps->ast[n].type == AST_CAT) {
+        flatten(ps, ps->ast[n].a, out, num);
+        flatten(ps, ps->ast[n].b, out, num);
+    }
+    else
+        out[(*num)++] = n;
+}
+
+struct literal {
+    char s[RX_LITERAL_MAX];
+    size_t len;
+};
+
+static void keep_longer (struct literal* best, const struct literal* lit)
+{
+    if (lit->len > best->len)
+        *best = *lit;
+}
+
+/* The longest run of bytes every match of node "n" has to contain.
+ * Sets *exact if the node matches nothing but that run. */
+static int best_literal (const struct parser* ps, int n, struct literal* best, int* exact)
+{
+    struct literal run = { .len = 0 };
+    struct literal sub;
+    const struct ast* a;
+    int* factors;
+    size_t num = 0, i;
+    int c, sub_exact;
+
+    best->len = 0;
+    *exact = 1;
+
+    factors = malloc(ps->num_ast * sizeof(*factors));
+    if (!factors)
+        return -1;
+    flatten(ps, n, factors, &num);
+
+    for (i = 0; i < num; i++) {
+        a = &ps->ast[factors[i]];
+        c = single_byte(ps, a);
+        if (c >= 0 && run.len < RX_LITERAL_MAX) {
+            run.s[run.len++] = c;
+            continue;
+        }
+        if (a->type == AST_EMPTY)
+            continue;
+
+        /* anything else ends the run */
+        *exact = 0;
+        keep_longer(best, &run);
+        run.len = 0;
+        if (a->type == AST_REPEAT && a->min > 0) {
+            if (best_literal(ps, a->a, &sub, &sub_exact) < 0) {
+                free(factors);
+                return -1;
+            }
+            keep_longer(best, &sub);
+        }
+    }
+    keep_longer(best, &run);
+    if (!best->len)
+        *exact = 0;
+
+    free(factors);
+    return 0;
+}
+
+/* the length of the longest match, SIZE_MAX if there is no limit */
+static size_t max_match (const struct parser* ps, int n)
+{
+    const struct ast* a = &ps->ast[n];
+    size_t x, y;
+
+    switch (a->type) {
+    case AST_SET:
+        return 1;
+    case AST_CAT:
+        x = max_match(ps, a->a);
+        y = max_match(ps, a->b);
+        return x == SIZE_MAX || y == SIZE_MAX ? SIZE_MAX : x + y;
+    case AST_ALT:
+        x = max_match(ps, a->a);
+        y = max_match(ps, a->b);
+        return x > y ? x : y;
+    case AST_REPEAT:
+        x = max_match(ps, a->a);
+        if (!x)
+            return 0;
+        if (a->max < 0 || x == SIZE_MAX)
+            return SIZE_MAX;
+        return x * a->max;
+    default:
+        return 0;
+    }
+}
+
+/* Split the bytes into classes that no set tells apart.  The newline
+ * always has a class of its own, as it ends the line. */
+static void make_classes (struct rx* rx, size_t num_sets)
+{
+    uint8_t next[256];
+    int16_t remap[512];
+    size_t i, nc = 2;
+    int b, k;
+
+    memset(rx->classes, 0, sizeof(rx->classes));
+    rx->classes['\n'] = 1;
+
+    for (i = 0; i < num_sets; i++) {
+        memset(remap, -1, sizeof(remap));
+        nc = 0;
+        for (b = 0; b < 256; b++) {
+            k = rx->classes[b] * 2 + set_has(&rx->sets[i], b);
+            if (remap[k] < 0)
+                remap[k] = nc++;
+            next[b] = remap[k];
+        }
+        memcpy(rx->classes, next, sizeof(next));
+    }
+
+    rx->num_classes = nc;
+    for (b = 255; b >= 0; b--)
+        rx->class_byte[rx->classes[b]] = b;
+    rx->nl_class = rx->classes['\n'];
+}
+/***************************/
+
+
+/***** COMPILING *************************************/
+struct compiler {
+    const struct parser* ps;
+    struct nfa_node* nodes;
+    size_t num;
+    size_t max;
+    const char* error;
+};
+
+static long emit_node (struct compiler* cc, int type, uint32_t set, uint32_t out,
+                       uint32_t out1)
+{
+    struct nfa_node* tmp;
+    size_t max;
+
+    if (cc->num == cc->max) {
+        if (cc->max >= RX_MAX_NODES) {
+            cc->error = "regular expression too big";
+            return -1;
+        }
+        max = cc->max ? 2 * cc->max : 64;
+        tmp = realloc(cc->nodes, max * sizeof(*tmp));
+        if (!tmp) {
+            cc->error = "out of memory";
+            return -1;
+        }
+        cc->nodes = tmp;
+        cc->max = max;
+    }
+
+    cc->nodes[cc->num].type = type;
+    cc->nodes[cc->num].set = set;
+    cc->nodes[cc->num].out = out;
+    cc->nodes[cc->num].out1 = out1;
+
+    return cc->num++;
+}
+
+static long emit (struct compiler* cc, int n, uint32_t next);
+
+/* Repetition by copying the operand: x{2,4} is x x (x (x)?)? and
+ * x{2,} is x x+ */
+static long emit_repeat (struct compiler* cc, const struct ast* a, uint32_t next)
+{
+    long cur = next, loop, body;
+    int i, need = a->min;
+
+    if (a->max < 0) {
+        loop = emit_node(cc, NFA_SPLIT, 0, 0, next);
+        if (loop < 0)
+            return -1;
+        body = emit(cc, a->a, loop);
+        if (body < 0)
+            return -1;
+        cc->nodes[loop].out = body;
+        if (need > 0) {
+            cur = body;
+            need--;
+        }
+        else
+            cur = loop;
+    }
+    else {
+        for (i = a->min; i < a->max; i++) {
+            body = emit(cc, a->a, cur);
+            if (body < 0)
+                return -1;
+            cur = emit_node(cc, NFA_SPLIT, 0, body, next);
+            if (cur < 0)
+                return -1;
+        }
+    }
+
+    for (i = 0; i < need && cur >= 0; i++)
+        cur = emit(cc, a->a, cur);
+
+    return cur;
+}
+
+/* Emit the NFA for node "n", leading on to "next".  Returns its entry. */
+static long emit (struct compiler* cc, int n, uint32_t next)
+{
+    const struct ast* a = &cc->ps->ast[n];
+    long x, y;
+
+    switch (a->type) {
+    case AST_SET:
+        return emit_node(cc, NFA_SET, a->set, next, 0);
+    case AST_BOL:
+        return emit_node(cc, NFA_BOL, 0, next, 0);
+    case AST_EOL:
+        return emit_node(cc, NFA_EOL, 0, next, 0);
+    case AST_CAT:
+        x = emit(cc, a->b, next);
+        return x < 0 ? -1 : emit(cc, a->a, x);
+    case AST_ALT:
+        x = emit(cc, a->a, next);
+        y = x < 0 ? -1 : emit(cc, a->b, next);
+        return y < 0 ? -1 : emit_node(cc, NFA_SPLIT, 0, x, y);
+    case AST_REPEAT:
+        return emit_repeat(cc, a, next);
+    default:
+        return next;
+    }
+}
+
+/* Compile patterns[0..num), any of which may match, with RX_* "flags".
+ * Returns NULL and points *error at the reason if one of them is no
+ * good. */
+struct rx* rx_compile (char* const* patterns, size_t num, int flags, const char** error)
+{
+    struct parser ps = { 0 };
+    struct compiler cc = { 0 };
+    struct literal lit;
+    struct rx* rx;
+    long match, start;
+    int root = -1, n;
+    size_t i;
+
+    rx = calloc(1, sizeof(*rx));
+    if (!rx) {
+        *error = "out of memory";
+        return NULL;
+    }
+
+    /* without a UTF-8 locale only ASCII has a case */
+    ps.flags = flags;
+    if (flags & RX_ICASE)
+        ps.locale = newlocale(LC_CTYPE_MASK, "C.UTF-8", (locale_t)0);
+
+    for (i = 0; i < num; i++) {
+        ps.p = patterns[i];
+        ps.depth = 0;
+        n = flags & RX_LITERAL ? parse_literal(&ps) : parse_alt(&ps);
+        if (n >= 0 && root >= 0)
+            n = new_ast(&ps, AST_ALT, root, n);
+        if (n < 0)
+            goto fail;
+        root = n;
+    }
+    if (root < 0) {
+        ps.error = "no pattern";
+        goto fail;
+    }
+    if (flags & RX_WORDS) {
+        root = word_bounded(&ps, root);
+        if (root < 0)
+            goto fail;
+    }
+
+    if (best_literal(&ps, root, &lit, &rx->exact) < 0) {
+        ps.error = "out of memory";
+        goto fail;
+    }
+    memcpy(rx->literal, lit.s, lit.len);
+    rx->literal[lit.len] = '\0';
+    rx->literal_len = lit.len;
+    rx->exact = rx->exact && num == 1 && !memchr(lit.s, '\0', lit.len);
+    rx->max_len = max_match(&ps, root);
+
+    cc.ps = &ps;
+    match = emit_node(&cc, NFA_MATCH, 0, 0, 0);
+    start = match < 0 ? -1 : emit(&cc, root, match);
+    if (start < 0) {
+        ps.error = cc.error;
+        goto fail;
+    }
+    rx->nodes = cc.nodes;
+    rx->num_nodes = cc.num;
+    rx->start = start;
+
+    rx->sets = ps.sets;
+    make_classes(rx, ps.num_sets);
+
+    if (ps.locale)
+        freelocale(ps.locale);
+    free(ps.ast);
+    return rx;
+
+fail:
+    *error = ps.error;
+    if (ps.locale)
+        freelocale(ps.locale);
+    free(ps.ast);
+    free(ps.sets);
+    free(cc.nodes);
+    free(rx);
+    return NULL;
+}
+
+void rx_free (struct rx* rx)
+{
+    if (!rx)
+        return;
+
+    free(rx->nodes);
+    free(rx->sets);
+    free(rx);
+}
+
+/* The longest string every match contains (NUL terminated, "" if there
+ * is none).  Sets *exact if matching it is all the pattern does. */
+const char* rx_literal (const struct rx* rx, size_t* len, int* exact)
+{
+    *len = rx->literal_len;
+    *exact = rx->exact;
+    return rx->literal;
+}
+
+/* the length of the longest match, SIZE_MAX if there is no limit */
+size_t rx_max_len (const struct rx* rx)
+{
+    return rx->max_len;
+}
+/***************************/
+
+
+/***** THE LAZY DFA **********************************/
+static int cmp_u32 (const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Follow the empty transitions from the NFA states on the stack
+ * (d->stack[0..num)) and put the states that consume a byte, plus any
+ * "$" still waiting for the end of the line, into d->list, sorted.
+ * "bol" and "eol" say whether "^" and "$" hold.  Returns the length
+ * of the list; *match is set if the end of the pattern was reached. */
+static size_t closure (struct rx_dfa* d, size_t num, int bol, int eol, int* match)
+{
+    const struct nfa_node* nodes = d->rx->nodes;
+    const struct nfa_node* node;
+    size_t len = 0;
+    uint32_t n;
+
+    if (++d->stamp == 0) {
+        memset(d->mark, 0, d->rx->num_nodes * sizeof(*d->mark));
+        d->stamp = 1;
+    }
+
+    *match = 0;
+    while (num) {
+        n = d->stack[--num];
+        if (d->mark[n] == d->stamp)
+            continue;
+        d->mark[n] = d->stamp;
+
+        node = &nodes[n];
+        switch (node->type) {
+        case NFA_SET:
+            d->list[len++] = n;
+            break;
+        case NFA_MATCH:
+            *match = 1;
+            break;
+        case NFA_SPLIT:
+            d->stack[num++] = node->out;
+            d->stack[num++] = node->out1;
+            break;
+        case NFA_BOL:
+            if (bol)
+                d->stack[num++] = node->out;
+            break;
+        case NFA_EOL:
+            if (eol)
+                d->stack[num++] = node->out;
+            else
+                d->list[len++] = n;
+            break;
+        }
+    }
+
+    qsort(d->list, len, sizeof(*d->list), cmp_u32);
+    return len;
+}
+
+/* Throw away every state: the DFA is rebuilt from scratch */
+static void dfa_flush (struct rx_dfa* d)
+{
+    d->num_states = 0;
+    d->pool_len = 0;
+    memset(d->table, -1, (d->table_mask + 1) * sizeof(*d->table));
+    d->line_start = -1;
+    d->generation++;
+}
+
+/* The state for the NFA states in d->list[0..len), made if need be */
+static int32_t dfa_intern (struct rx_dfa* d, size_t len, int bol)
+{
+    const uint32_t* set;
+    uint32_t h = 2166136261u ^ bol;
+    size_t i, num;
+    int32_t id;
+    int match;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ d->list[i]) * 16777619u;
+
+    for (i = h & d->table_mask; (id = d->table[i]) >= 0; i = (i + 1) & d->table_mask) {
+        if (d->hashes[id] == h && d->bol[id] == bol && d->set_len[id] == len
+                && !memcmp(d->pool + d->set_off[id], d->list, len * sizeof(*d->list)))
+            return id;
+    }
+
+    if (d->num_states == d->max_states || d->pool_len + len > d->pool_max) {
+        dfa_flush(d);
+        for (i = h & d->table_mask; d->table[i] >= 0; i = (i + 1) & d->table_mask)
+            ;
+    }
+
+    id = d->num_states++;
+    d->table[i] = id;
+    d->hashes[id] = h;
+    d->bol[id] = bol;
+    d->set_off[id] = d->pool_len;
+    d->set_len[id] = len;
+    memcpy(d->pool + d->pool_len, d->list, len * sizeof(*d->list));
+    d->pool_len += len;
+    memset(d->trans + id * d->num_classes, -1, d->num_classes * sizeof(*d->trans));
+
+    /* would the end of the line complete a match? */
+    set = d->pool + d->set_off[id];
+    for (num = 0; num < len; num++)
+        d->stack[num] = set[num];
+    closure(d, len, bol, 1, &match);
+    d->eol_match[id] = match;
+
+    return id;
+}
+
+static int32_t dfa_line_start (struct rx_dfa* d)
+{
+    size_t len;
+    int match;
+
+    if (d->line_start < 0) {
+        d->stack[0] = d->rx->start;
+        len = closure(d, 1, 1, 0, &match);
+        d->line_start = dfa_intern(d, len, 1);
+    }
+
+    return d->line_start;
+}
+
+/* Work out (and remember) where state "s" goes on a byte of class "c".
+ * Returns the row of the state it goes to, or RX_MATCH. */
+static int32_t dfa_step (struct rx_dfa* d, int32_t s, unsigned int c)
+{
+    const struct rx* rx = d->rx;
+    const uint32_t* set = d->pool + d->set_off[s];
+    const struct nfa_node* node;
+    unsigned int byte = rx->class_byte[c];
+    unsigned int generation = d->generation;
+    size_t i, num = 0, len;
+    int32_t t;
+    int match;
+
+    if (c == rx->nl_class)
+        t = d->eol_match[s] ? RX_MATCH : dfa_line_start(d) * (int32_t)d->num_classes;
+    else {
+        for (i = 0; i < d->set_len[s]; i++) {
+            node = &rx->nodes[set[i]];
+            if (node->type == NFA_SET && set_has(&rx->sets[node->set], byte))
+                d->stack[num++] = node->out;
+        }
+        /* a match may start at any byte */
+        d->stack[num++] = rx->start;
+
+        len = closure(d, num, 0, 0, &match);
+        t = match ? RX_MATCH : dfa_intern(d, len, 0) * (int32_t)d->num_classes;
+    }
+
+    /* unless "s" went with the rest of the DFA in the meantime */
+    if (d->generation == generation)
+        d->trans[s * d->num_classes + c] = t;
+
+    return t;
+}
+
+struct rx_dfa* rx_dfa_new (const struct rx* rx)
+{
+    struct rx_dfa* d;
+    size_t nn = rx->num_nodes, table_size = 1;
+    int match;
+
+    d = calloc(1, sizeof(*d));
+    if (!d)
+        return NULL;
+    d->rx = rx;
+    d->num_classes = rx->num_classes;
+
+    d->max_states = RX_DFA_MEMORY / (rx->num_classes * sizeof(*d->trans));
+    while (table_size < 2 * d->max_states)
+        table_size *= 2;
+    d->table_mask = table_size - 1;
+    d->pool_max = nn * 16 > 65536 ? nn * 16 : 65536;
+
+    d->trans = malloc(d->max_states * rx->num_classes * sizeof(*d->trans));
+    d->eol_match = malloc(d->max_states * sizeof(*d->eol_match));
+    d->bol = malloc(d->max_states * sizeof(*d->bol));
+    d->set_off = malloc(d->max_states * sizeof(*d->set_off));
+    d->set_len = malloc(d->max_states * sizeof(*d->set_len));
+    d->hashes = malloc(d->max_states * sizeof(*d->hashes));
+    d->pool = malloc(d->pool_max * sizeof(*d->pool));
+    d->table = malloc(table_size * sizeof(*d->table));
+    d->list = malloc(nn * sizeof(*d->list));
+    d->stack = malloc((3 * nn + 2) * sizeof(*d->stack));
+    d->mark = calloc(nn, sizeof(*d->mark));
+    if (!d->trans || !d->eol_match || !d->bol || !d->set_off || !d->set_len || !d->hashes
+            || !d->pool || !d->table || !d->list || !d->stack || !d->mark) {
+        rx_dfa_free(d);
+        return NULL;
+    }
+    dfa_flush(d);
+
+    /* if the empty string matches, so does every line */
+    d->stack[0] = rx->start;
+    closure(d, 1, 1, 0, &match);
+    d->every_line = match;
+
+    return d;
+}
+
+void rx_dfa_free (struct rx_dfa* d)
+{
+    if (!d)
+        return;
+
+    free(d->trans);
+    free(d->eol_match);
+    free(d->bol);
+    free(d->set_off);
+    free(d->set_len);
+    free(d->hashes);
+    free(d->pool);
+    free(d->table);
+    free(d->list);
+    free(d->stack);
+    free(d->mark);
+    free(d);
+}
+
+/* Find a match in buf[0..len), which starts at the start of a line.
+ * Returns a pointer into the matching line (to the byte that completed
+ * the match, or the newline ending the line for a match ending in "$"),
+ * or NULL if no line matches. */
+const char* rx_find (struct rx_dfa* d, const char* buf, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    const unsigned char* end = p + len;
+    const uint8_t* classes = d->rx->classes;
+    int32_t nc = d->num_classes;
+    int32_t s, t;
+
+    if (!len)
+        return NULL;
+    if (d->every_line)
+        return buf;
+
+    /* s is the current state's row of the table */
+    s = dfa_line_start(d) * nc;
+    for (; p < end; p++) {
+        t = d->trans[s + classes[*p]];
+        if (t < 0) {
+            if (t == RX_MATCH)
+                return (const char*)p;
+            t = dfa_step(d, s / nc, classes[*p]);
+            if (t == RX_MATCH)
+                return (const char*)p;
+        }
+        s = t;
+    }
+
+    /* the last line need not end in a newline */
+    if (end[-1] != '\n' && d->eol_match[s / nc])
+        return (const char*)end - 1;
+
+    return NULL;
+}
+/***************************/
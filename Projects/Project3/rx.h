@@ -0,0 +1,26 @@
+#ifndef _rx_h_
+#define _rx_h_
+
+#include <stddef.h>
+
+/* a compiled regular expression, shared by every thread */
+struct rx;
+
+/* a thread's DFA for it, built as the search goes */
+struct rx_dfa;
+
+/* rx_compile flags */
+#define RX_ICASE 0x1            /* ignore case (-i) */
+#define RX_WORDS 0x2            /* only matches that are whole words (-w) */
+#define RX_LITERAL 0x4          /* the patterns are plain strings */
+
+struct rx* rx_compile (char* const* patterns, size_t num, int flags, const char** error);
+void rx_free (struct rx* rx);
+const char* rx_literal (const struct rx* rx, size_t* len, int* exact);
+size_t rx_max_len (const struct rx* rx);
+
+struct rx_dfa* rx_dfa_new (const struct rx* rx);
+void rx_dfa_free (struct rx_dfa* d);
+const char* rx_find (struct rx_dfa* d, const char* buf, size_t len);
+
+#endif /* _rx_h_ */
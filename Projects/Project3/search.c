@@ -0,0 +1,389 @@
+/******************************************************************************
+ * search.c - substring search kernels for minigrep
+ *
+ * The vector kernels use the "first and last byte" candidate filter:
+ * for every window of 16 (SSE2) or 32 (AVX2) starting positions, compare
+ * the haystack against the needle's first byte and, offset by m - 1,
+ * against its last byte.  Only positions where both agree are checked
+ * with memcmp, which on real text is a tiny fraction of the input.
+ *
+ * The case-insensitive kernels (-i) take a needle already folded to
+ * lower case and use the same filter on the haystack with bit 5 forced
+ * on wherever the needle has a letter: for a lower case letter c,
+ * (x | 0x20) == c holds for exactly x == c and its upper case, so the
+ * filter costs one extra OR per vector and lets no false candidates
+ * through.  The candidates are then compared folding ASCII only.
+ *
+ * The byte counting kernels (used to recover line numbers) compare a
+ * vector at a time against the byte and accumulate the 0/-1 results in
+ * per-lane 8 bit counters, folding them into 64 bit sums with psadbw
+ * before the lanes can overflow.
+ *
+ * search_init() picks the widest kernels the CPU supports (via CPUID)
+ * and stores them in search_find, search_find_icase and search_count;
+ * search_use() picks them by name, which is how "make test" runs every
+ * kernel.
+ ******************************************************************************/
+
+#include <string.h>
+#include <stdint.h>
+
+#include "search.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+static const char* search_scalar (const char* hay, size_t n,
+                                  const char* needle, size_t m);
+static const char* search_icase_scalar (const char* hay, size_t n,
+                                        const char* needle, size_t m);
+static size_t count_scalar (const char* buf, size_t len, char c);
+
+search_fn_t search_find = search_scalar;
+search_fn_t search_find_icase = search_icase_scalar;
+count_fn_t search_count = count_scalar;
+static const char* impl_name = "scalar";
+
+
+/* Portable fallback: let memchr find candidates for the first byte and
+ * check the last byte before paying for a full compare */
+static const char* search_scalar (const char* hay, size_t n,
+                                  const char* needle, size_t m)
+{
+    const char* end;
+    const char* p;
+
+    if (m == 0)
+        return hay;
+    if (m > n)
+        return NULL;
+
+    end = hay + n - m + 1;
+    for (p = hay; p < end; p++) {
+        p = memchr(p, needle[0], end - p);
+        if (!p)
+            return NULL;
+        if (p[m - 1] == needle[m - 1] && !memcmp(p + 1, needle + 1, m - 1))
+            return p;
+    }
+
+    return NULL;
+}
+
+
+static inline unsigned char fold (unsigned char c)
+{
+    return c - 'A' < 26u ? c | 0x20 : c;
+}
+
+/* does hay[0..m) equal the (folded) needle[0..m), ignoring ASCII case? */
+static inline int icase_equal (const char* hay, const char* needle, size_t m)
+{
+    size_t i;
+
+    for (i = 0; i < m; i++)
+        if (fold(hay[i]) != (unsigned char)needle[i])
+            return 0;
+
+    return 1;
+}
+
+static const char* search_icase_scalar (const char* hay, size_t n,
+                                        const char* needle, size_t m)
+{
+    const unsigned char first = needle[0];
+    const char* end;
+    const char* p;
+
+    if (m == 0)
+        return hay;
+    if (m > n)
+        return NULL;
+
+    end = hay + n - m + 1;
+    for (p = hay; p < end; p++) {
+        if (fold(p[0]) == first && icase_equal(p + 1, needle + 1, m - 1))
+            return p;
+    }
+
+    return NULL;
+}
+
+
+static size_t count_scalar (const char* buf, size_t len, char c)
+{
+    const char* end = buf + len;
+    size_t n = 0;
+
+    while ((buf = memchr(buf, c, end - buf)) != NULL) {
+        n++;
+        buf++;
+    }
+
+    return n;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+/* check every candidate position flagged in "mask" (bit i = hay[i]) */
+static inline const char* verify_candidates (const char* hay, unsigned int mask,
+                                             const char* needle, size_t m)
+{
+    unsigned int bit;
+
+    while (mask) {
+        bit = __builtin_ctz(mask);
+        if (!memcmp(hay + bit + 1, needle + 1, m - 2))
+            return hay + bit;
+        mask &= mask - 1;
+    }
+
+    return NULL;
+}
+
+__attribute__((target("sse2")))
+static const char* search_sse2 (const char* hay, size_t n,
+                                const char* needle, size_t m)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    __m128i blk_first, blk_last;
+    unsigned int mask;
+    const char* found;
+    size_t i;
+
+    if (m < 2 || m > n)
+        return search_scalar(hay, n, needle, m);
+
+    /* the loads for window i touch hay[i .. i + m - 1 + 16) */
+    for (i = 0; i + m - 1 + 16 <= n; i += 16) {
+        blk_first = _mm_loadu_si128((const __m128i*)(hay + i));
+        blk_last = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blk_first, first),
+                                               _mm_cmpeq_epi8(blk_last, last)));
+        if (mask) {
+            found = verify_candidates(hay + i, mask, needle, m);
+            if (found)
+                return found;
+        }
+    }
+
+    return search_scalar(hay + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2")))
+static const char* search_avx2 (const char* hay, size_t n,
+                                const char* needle, size_t m)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    __m256i blk_first, blk_last;
+    unsigned int mask;
+    const char* found;
+    size_t i;
+
+    if (m < 2 || m > n)
+        return search_scalar(hay, n, needle, m);
+
+    for (i = 0; i + m - 1 + 32 <= n; i += 32) {
+        blk_first = _mm256_loadu_si256((const __m256i*)(hay + i));
+        blk_last = _mm256_loadu_si256((const __m256i*)(hay + i + m - 1));
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(blk_first, first),
+                                                     _mm256_cmpeq_epi8(blk_last, last)));
+        if (mask) {
+            found = verify_candidates(hay + i, mask, needle, m);
+            if (found)
+                return found;
+        }
+    }
+
+    return search_sse2(hay + i, n - i, needle, m);
+}
+
+
+/* bit 5 wherever the needle byte is a letter, so that OR-ing it into the
+ * haystack folds just the bytes compared against letters */
+static inline char case_bit (char c)
+{
+    return c - 'a' < 26u ? 0x20 : 0;
+}
+
+static inline const char* verify_candidates_icase (const char* hay, unsigned int mask,
+                                                   const char* needle, size_t m)
+{
+    unsigned int bit;
+
+    while (mask) {
+        bit = __builtin_ctz(mask);
+        if (icase_equal(hay + bit + 1, needle + 1, m - 2))
+            return hay + bit;
+        mask &= mask - 1;
+    }
+
+    return NULL;
+}
+
+__attribute__((target("sse2")))
+static const char* search_icase_sse2 (const char* hay, size_t n,
+                                      const char* needle, size_t m)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    const __m128i first_case = _mm_set1_epi8(case_bit(needle[0]));
+    const __m128i last_case = _mm_set1_epi8(case_bit(needle[m - 1]));
+    __m128i blk_first, blk_last;
+    unsigned int mask;
+    const char* found;
+    size_t i;
+
+    if (m < 2 || m > n)
+        return search_icase_scalar(hay, n, needle, m);
+
+    for (i = 0; i + m - 1 + 16 <= n; i += 16) {
+        blk_first = _mm_or_si128(_mm_loadu_si128((const __m128i*)(hay + i)), first_case);
+        blk_last = _mm_or_si128(_mm_loadu_si128((const __m128i*)(hay + i + m - 1)),
+                                last_case);
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blk_first, first),
+                                               _mm_cmpeq_epi8(blk_last, last)));
+        if (mask) {
+            found = verify_candidates_icase(hay + i, mask, needle, m);
+            if (found)
+                return found;
+        }
+    }
+
+    return search_icase_scalar(hay + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2")))
+static const char* search_icase_avx2 (const char* hay, size_t n,
+                                      const char* needle, size_t m)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    const __m256i first_case = _mm256_set1_epi8(case_bit(needle[0]));
+    const __m256i last_case = _mm256_set1_epi8(case_bit(needle[m - 1]));
+    __m256i blk_first, blk_last;
+    unsigned int mask;
+    const char* found;
+    size_t i;
+
+    if (m < 2 || m > n)
+        return search_icase_scalar(hay, n, needle, m);
+
+    for (i = 0; i + m - 1 + 32 <= n; i += 32) {
+        blk_first = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(hay + i)),
+                                    first_case);
+        blk_last = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(hay + i + m - 1)),
+                                   last_case);
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(blk_first, first),
+                                                     _mm256_cmpeq_epi8(blk_last, last)));
+        if (mask) {
+            found = verify_candidates_icase(hay + i, mask, needle, m);
+            if (found)
+                return found;
+        }
+    }
+
+    return search_icase_sse2(hay + i, n - i, needle, m);
+}
+
+
+__attribute__((target("sse2")))
+static size_t count_sse2 (const char* buf, size_t len, char c)
+{
+    const __m128i target = _mm_set1_epi8(c);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i blk, acc, sums = zero;
+    uint64_t lanes[2];
+    size_t i = 0, run;
+
+    while (len - i >= 16) {
+        /* each lane can count at most 255 hits before it wraps */
+        acc = zero;
+        for (run = 0; run < 255 && len - i >= 16; run++, i += 16) {
+            blk = _mm_loadu_si128((const __m128i*)(buf + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(blk, target));
+        }
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(acc, zero));
+    }
+
+    /* through memory, as the 64 bit moves out of a vector are x86-64
+     * only */
+    _mm_storeu_si128((__m128i*)lanes, sums);
+
+    return lanes[0] + lanes[1] + count_scalar(buf + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2 (const char* buf, size_t len, char c)
+{
+    const __m256i target = _mm256_set1_epi8(c);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i blk, acc, sums = zero;
+    uint64_t lanes[4];
+    size_t i = 0, run;
+
+    while (len - i >= 32) {
+        acc = zero;
+        for (run = 0; run < 255 && len - i >= 32; run++, i += 32) {
+            blk = _mm256_loadu_si256((const __m256i*)(buf + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(blk, target));
+        }
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(acc, zero));
+    }
+
+    _mm256_storeu_si256((__m256i*)lanes, sums);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_sse2(buf + i, len - i, c);
+}
+#endif
+
+
+/* Point search_find, search_find_icase and search_count at the kernels
+ * called "name": "scalar", "sse2" or "avx2".  Returns -1, changing
+ * nothing, if this build or CPU doesn't have them. */
+int search_use (const char* name)
+{
+    if (!strcmp(name, "scalar")) {
+        search_find = search_scalar;
+        search_find_icase = search_icase_scalar;
+        search_count = count_scalar;
+        impl_name = "scalar";
+        return 0;
+    }
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+        search_find = search_avx2;
+        search_find_icase = search_icase_avx2;
+        search_count = count_avx2;
+        impl_name = "avx2";
+        return 0;
+    }
+    if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) {
+        search_find = search_sse2;
+        search_find_icase = search_icase_sse2;
+        search_count = count_sse2;
+        impl_name = "sse2";
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+/* the widest kernels the CPU supports */
+void search_init (void)
+{
+    if (search_use("avx2") < 0 && search_use("sse2") < 0)
+        search_use("scalar");
+}
+
+const char* search_impl_name (void)
+{
+    return impl_name;
+}
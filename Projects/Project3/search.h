@@ -0,0 +1,30 @@
+#ifndef _search_h_
+#define _search_h_
+
+#include <stddef.h>
+
+/* returns a pointer to the first occurrence of needle[0..m) within
+ * hay[0..n), or NULL if there is none */
+typedef const char* (*search_fn_t)(const char* hay, size_t n,
+                                   const char* needle, size_t m);
+
+/* returns the number of bytes equal to c in buf[0..len) */
+typedef size_t (*count_fn_t)(const char* buf, size_t len, char c);
+
+/* search_find_icase ignores ASCII case; the needle must be in lower case */
+extern search_fn_t search_find;
+extern search_fn_t search_find_icase;
+extern count_fn_t search_count;
+
+/* word constituents for -w: ASCII letters, digits and "_", and any byte
+ * of a multibyte character */
+static inline int search_is_word (unsigned char c)
+{
+    return (c | 0x20) - 'a' < 26u || c - '0' < 10u || c == '_' || c >= 0x80;
+}
+
+void search_init (void);
+int search_use (const char* name);
+const char* search_impl_name (void);
+
+#endif /* _search_h_ */
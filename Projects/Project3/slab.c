@@ -0,0 +1,265 @@
+/******************************************************************************
+ * slab.c - per-thread small object allocator for minigrep
+ *
+ * A search allocates and frees a work item (and, with --sorted, a
+ * seq_node) for every directory entry it meets, so at millions of small
+ * files malloc is hit millions of times from every worker at once.
+ * Small objects are instead handed out from per-thread free lists, one
+ * per 16 byte size class, refilled by carving up large blocks.  An
+ * object may be freed by a different thread than the one that made it;
+ * it simply joins the freeing thread's list.  When a list grows past
+ * SLAB_CACHE_MAX half of it moves to a shared list for the class, where
+ * threads that are short of objects look before carving new ones.
+ *
+ * Blocks are only given back by slab_destroy, once the search is over.
+ * Threads without a cache of their own share one under a lock.  Builds
+ * with AddressSanitizer go straight to malloc so it can still see
+ * use-after-free bugs.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "slab.h"
+
+#define SLAB_BLOCK_SIZE (256 * 1024)
+#define SLAB_CACHE_MAX 512
+
+#if defined(__SANITIZE_ADDRESS__)
+#define SLAB_USE_MALLOC 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SLAB_USE_MALLOC 1
+#endif
+#endif
+
+/* a block is a header followed by the objects carved out of it */
+struct slab_block {
+    struct slab_block* next;
+    char pad[SLAB_ALIGN - sizeof(struct slab_block*)];
+};
+
+struct slab_central {
+    pthread_mutex_t lock;
+    void* free;
+};
+
+static __thread struct slab_cache* slab_self;
+
+static struct slab_cache shared_cache;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct slab_central central[SLAB_NUM_CLASSES] = {
+    [0 ... SLAB_NUM_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL }
+};
+
+static struct slab_block* blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static inline size_t slab_class (size_t size)
+{
+    return size ? (size - 1) / SLAB_ALIGN : 0;
+}
+
+static inline void* obj_next (void* p)
+{
+    return *(void**)p;
+}
+
+static inline void obj_set_next (void* p, void* next)
+{
+    *(void**)p = next;
+}
+
+
+static void cache_init (struct slab_cache* cache)
+{
+    size_t c;
+
+    for (c = 0; c < SLAB_NUM_CLASSES; c++) {
+        cache->free[c] = NULL;
+        cache->num_free[c] = 0;
+    }
+    cache->bump = NULL;
+    cache->bump_end = NULL;
+}
+
+/* Make "cache" the calling thread's own */
+void slab_attach (struct slab_cache* cache)
+{
+    cache_init(cache);
+    slab_self = cache;
+}
+
+/* Move the "num" objects at the head of the cache's list for class "c"
+ * to the shared list */
+static void slab_release (struct slab_cache* cache, size_t c, unsigned int num)
+{
+    void* head = cache->free[c];
+    void* tail = head;
+    unsigned int i;
+
+    if (!num)
+        return;
+
+    for (i = 1; i < num; i++)
+        tail = obj_next(tail);
+    cache->free[c] = obj_next(tail);
+    cache->num_free[c] -= num;
+
+    pthread_mutex_lock(&central[c].lock);
+    obj_set_next(tail, central[c].free);
+    central[c].free = head;
+    pthread_mutex_unlock(&central[c].lock);
+}
+
+/* The calling thread is done: hand its free objects over to the shared
+ * lists so other threads can use them */
+void slab_detach (void)
+{
+    struct slab_cache* cache = slab_self;
+    size_t c;
+
+    if (!cache)
+        return;
+
+    for (c = 0; c < SLAB_NUM_CLASSES; c++)
+        slab_release(cache, c, cache->num_free[c]);
+
+    slab_self = NULL;
+}
+
+/* Free every block.  Only once the search is over and every other
+ * thread has detached: any object still around is gone after this. */
+void slab_destroy (void)
+{
+    struct slab_block* block;
+    size_t c;
+
+    slab_self = NULL;
+
+    while ((block = blocks) != NULL) {
+        blocks = block->next;
+        free(block);
+    }
+
+    for (c = 0; c < SLAB_NUM_CLASSES; c++)
+        central[c].free = NULL;
+    cache_init(&shared_cache);
+}
+
+
+/* The cache has no objects of class "c" left: take a batch from the
+ * shared list or, failing that, carve one out of a block */
+static void* slab_refill (struct slab_cache* cache, size_t c)
+{
+    struct slab_block* block;
+    size_t size = (c + 1) * SLAB_ALIGN;
+    unsigned int num = 0;
+    void* head;
+    void* tail;
+    char* p;
+
+    pthread_mutex_lock(&central[c].lock);
+    head = tail = central[c].free;
+    if (head) {
+        for (num = 1; num < SLAB_CACHE_MAX / 2 && obj_next(tail); num++)
+            tail = obj_next(tail);
+        central[c].free = obj_next(tail);
+    }
+    pthread_mutex_unlock(&central[c].lock);
+
+    if (head) {
+        /* keep the first one, cache the rest */
+        obj_set_next(tail, NULL);
+        cache->free[c] = obj_next(head);
+        cache->num_free[c] = num - 1;
+        return head;
+    }
+
+    if (cache->bump_end - cache->bump < (ptrdiff_t)size) {
+        block = malloc(SLAB_BLOCK_SIZE);
+        if (!block)
+            return NULL;
+
+        pthread_mutex_lock(&blocks_lock);
+        block->next = blocks;
+        blocks = block;
+        pthread_mutex_unlock(&blocks_lock);
+
+        cache->bump = (char*)(block + 1);
+        cache->bump_end = (char*)block + SLAB_BLOCK_SIZE;
+    }
+
+    p = cache->bump;
+    cache->bump += size;
+
+    return p;
+}
+
+static void* cache_alloc (struct slab_cache* cache, size_t c)
+{
+    void* p = cache->free[c];
+
+    if (!p)
+        return slab_refill(cache, c);
+
+    cache->free[c] = obj_next(p);
+    cache->num_free[c]--;
+
+    return p;
+}
+
+static void cache_free (struct slab_cache* cache, size_t c, void* p)
+{
+    obj_set_next(p, cache->free[c]);
+    cache->free[c] = p;
+
+    if (++cache->num_free[c] > SLAB_CACHE_MAX)
+        slab_release(cache, c, SLAB_CACHE_MAX / 2);
+}
+
+
+/* Allocate "size" bytes, aligned to SLAB_ALIGN */
+void* slab_alloc (size_t size)
+{
+#ifndef SLAB_USE_MALLOC
+    void* p;
+
+    if (size <= SLAB_MAX_SIZE) {
+        if (slab_self)
+            return cache_alloc(slab_self, slab_class(size));
+
+        pthread_mutex_lock(&shared_lock);
+        p = cache_alloc(&shared_cache, slab_class(size));
+        pthread_mutex_unlock(&shared_lock);
+        return p;
+    }
+#endif
+
+    return malloc(size);
+}
+
+/* Free "p", which was allocated by slab_alloc(size) */
+void slab_free (void* p, size_t size)
+{
+    if (!p)
+        return;
+
+#ifndef SLAB_USE_MALLOC
+    if (size <= SLAB_MAX_SIZE) {
+        if (slab_self)
+            cache_free(slab_self, slab_class(size), p);
+        else {
+            pthread_mutex_lock(&shared_lock);
+            cache_free(&shared_cache, slab_class(size), p);
+            pthread_mutex_unlock(&shared_lock);
+        }
+        return;
+    }
+#endif
+
+    free(p);
+}
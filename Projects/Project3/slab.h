@@ -0,0 +1,27 @@
+#ifndef _slab_h_
+#define _slab_h_
+
+#include <stddef.h>
+
+/* objects up to this size come from the slabs, bigger ones from malloc */
+#define SLAB_MAX_SIZE 512
+#define SLAB_ALIGN 16
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / SLAB_ALIGN)
+
+/* A thread's private stock of free objects, one list per size class,
+ * and the unused tail of the block it last carved objects out of */
+struct slab_cache {
+    void* free[SLAB_NUM_CLASSES];
+    unsigned int num_free[SLAB_NUM_CLASSES];
+    char* bump;
+    char* bump_end;
+};
+
+void slab_attach (struct slab_cache* cache);
+void slab_detach (void);
+void slab_destroy (void);
+
+void* slab_alloc (size_t size);
+void slab_free (void* p, size_t size);
+
+#endif /* _slab_h_ */
@@ -0,0 +1,91 @@
+/******************************************************************************
+ * stats.c - per-phase counters and timers for minigrep (--stats)
+ *
+ * Every searching thread owns a struct stats and points stats_self at
+ * it, so the probes in the hot paths are plain unshared increments and,
+ * unless --stats was given, the timers don't even read the clock.  The
+ * figures are summed up once the threads are done.
+ ******************************************************************************/
+
+#include <string.h>
+
+#include "stats.h"
+
+#if ENABLE_STATS
+int stats_enabled;
+__thread struct stats* stats_self;
+#endif
+
+static const char* phase_names[NUM_PHASES] = {
+    [PHASE_READDIR] = "readdir",
+    [PHASE_STAT] = "stat",
+    [PHASE_OPEN] = "open",
+    [PHASE_READ] = "read",
+    [PHASE_SEARCH] = "search",
+    [PHASE_OUTPUT] = "output",
+    [PHASE_IDLE] = "idle"
+};
+
+
+/* Turn the timers on.  Returns -1 if they were compiled out. */
+int stats_enable (void)
+{
+#if ENABLE_STATS
+    stats_enabled = 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* make "st" (which is cleared) the calling thread's stats; NULL
+ * detaches the thread */
+void stats_attach (struct stats* st)
+{
+#if ENABLE_STATS
+    if (st)
+        memset(st, 0, sizeof(*st));
+    stats_self = stats_enabled ? st : NULL;
+#endif
+}
+
+void stats_merge (struct stats* total, const struct stats* st)
+{
+    int i;
+
+    for (i = 0; i < NUM_PHASES; i++) {
+        total->phase_ns[i] += st->phase_ns[i];
+        total->phase_calls[i] += st->phase_calls[i];
+    }
+    for (i = 0; i < NUM_COUNTERS; i++)
+        total->counters[i] += st->counters[i];
+    if (st->queue_high_water > total->queue_high_water)
+        total->queue_high_water = st->queue_high_water;
+}
+
+/* Print the summed up figures.  Phase times are added up over all
+ * threads, so with several threads they can exceed the wall time. */
+void stats_report (FILE* stream, const struct stats* total, uint64_t bytes_scanned,
+                   double seconds)
+{
+    int i;
+
+    fprintf(stream, "\n---- stats ----\n");
+    fprintf(stream, "files visited       %llu\n",
+            (unsigned long long)total->counters[STAT_FILES]);
+    fprintf(stream, "dirs visited        %llu\n",
+            (unsigned long long)total->counters[STAT_DIRS]);
+    fprintf(stream, "bytes scanned       %llu (%.1f MB/s)\n",
+            (unsigned long long)bytes_scanned,
+            seconds > 0 ? bytes_scanned / seconds / (1 << 20) : 0.0);
+    fprintf(stream, "queue high-water    %llu\n",
+            (unsigned long long)total->queue_high_water);
+    fprintf(stream, "lock waits          %llu (%.3f ms)\n",
+            (unsigned long long)total->counters[STAT_LOCK_WAITS],
+            total->counters[STAT_LOCK_WAIT_NS] / 1e6);
+
+    fprintf(stream, "%-12s %12s %12s\n", "phase", "calls", "ms");
+    for (i = 0; i < NUM_PHASES; i++)
+        fprintf(stream, "%-12s %12llu %12.3f\n", phase_names[i],
+                (unsigned long long)total->phase_calls[i], total->phase_ns[i] / 1e6);
+}
@@ -0,0 +1,92 @@
+#ifndef _stats_h_
+#define _stats_h_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Build with -DENABLE_STATS=0 (make STATS=0) to compile every probe
+ * below down to nothing; --stats then only prints a warning. */
+#ifndef ENABLE_STATS
+#define ENABLE_STATS 1
+#endif
+
+/* where the time goes */
+enum stats_phase {
+    PHASE_READDIR,              /* listing directories */
+    PHASE_STAT,                 /* lstat/fstat */
+    PHASE_OPEN,                 /* opening files and directories */
+    PHASE_READ,                 /* mapping/reading files, io_uring waits */
+    PHASE_SEARCH,               /* scanning buffers for the string */
+    PHASE_OUTPUT,               /* handing over and writing output */
+    PHASE_IDLE,                 /* workers waiting for work */
+    NUM_PHASES
+};
+
+enum stats_counter {
+    STAT_FILES,
+    STAT_DIRS,
+    STAT_LOCK_WAITS,            /* contended lock acquisitions */
+    STAT_LOCK_WAIT_NS,          /* ... and the time spent in them */
+    NUM_COUNTERS
+};
+
+/* one thread's figures; threads never touch each other's */
+struct stats {
+    uint64_t phase_ns[NUM_PHASES];
+    uint64_t phase_calls[NUM_PHASES];
+    uint64_t counters[NUM_COUNTERS];
+    uint64_t queue_high_water;
+};
+
+static inline uint64_t monotonic_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if ENABLE_STATS
+extern int stats_enabled;
+extern __thread struct stats* stats_self;
+
+/* start timing a phase; returns 0 when --stats is off */
+static inline uint64_t stats_start (void)
+{
+    return stats_enabled ? monotonic_ns() : 0;
+}
+
+static inline void stats_stop (uint64_t start, enum stats_phase phase)
+{
+    if (start && stats_self) {
+        stats_self->phase_ns[phase] += monotonic_ns() - start;
+        stats_self->phase_calls[phase]++;
+    }
+}
+
+static inline void stats_add (enum stats_counter counter, uint64_t n)
+{
+    if (stats_self)
+        stats_self->counters[counter] += n;
+}
+
+static inline void stats_queue_length (uint64_t len)
+{
+    if (stats_self && len > stats_self->queue_high_water)
+        stats_self->queue_high_water = len;
+}
+#else
+static inline uint64_t stats_start (void) { return 0; }
+static inline void stats_stop (uint64_t start, enum stats_phase phase) { }
+static inline void stats_add (enum stats_counter counter, uint64_t n) { }
+static inline void stats_queue_length (uint64_t len) { }
+#endif
+
+int stats_enable (void);
+void stats_attach (struct stats* st);
+void stats_merge (struct stats* total, const struct stats* st);
+void stats_report (FILE* stream, const struct stats* total, uint64_t bytes_scanned,
+                   double seconds);
+
+#endif /* _stats_h_ */
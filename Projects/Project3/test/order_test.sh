@@ -0,0 +1,61 @@
+#!/bin/sh
+###############################################################################
+# order_test.sh - check that parallel --sorted output matches -S
+#
+# Generates a tree a few directories deep and compares the output of
+# -S with that of -P --sorted and -U --sorted, byte for byte, with no
+# memory budget and with --queue-memory budgets small enough to turn the
+# traversal depth first.
+#
+# Run with:
+#   $ make test
+###############################################################################
+
+minigrep=${1:-./minigrep}
+dir=$(mktemp -d "${TMPDIR:-/tmp}/minigrep-order.XXXXXX") || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+# four levels of four subdirectories, each with six files of which
+# every other one has a match or two
+make_dir () {
+    mkdir -p "$1"
+    for f in 0 1 2 3 4 5; do
+        if [ $((f % 2)) -eq 0 ]; then
+            printf 'a needle in %s/f%s\nhay\nneedle again\n' "$1" "$f" > "$1/f$f"
+        else
+            printf 'just hay\n' > "$1/f$f"
+        fi
+    done
+    if [ "$2" -gt 0 ]; then
+        for d in a b c d; do
+            make_dir "$1/$d" $(($2 - 1))
+        done
+    fi
+}
+make_dir "$dir/tree" 3
+
+# the report at the end has the time in it
+run () {
+    "$minigrep" "$@" 2>&1 | grep -v "Execution Time"
+}
+
+failed=0
+for budget in "" --queue-memory=1K --queue-memory=64K; do
+    run -S $budget "$dir/tree" needle > "$dir/want"
+    for mode in -P -U; do
+        run $mode --sorted $budget "$dir/tree" needle > "$dir/got"
+        if cmp -s "$dir/want" "$dir/got"; then
+            echo "order_test: $mode --sorted${budget:+ $budget}: same as -S"
+        else
+            echo "order_test: $mode --sorted${budget:+ $budget}: differs from -S"
+            diff "$dir/want" "$dir/got" | head -5
+            failed=1
+        fi
+    done
+done
+
+if [ $failed -ne 0 ]; then
+    echo "order_test: failed"
+    exit 1
+fi
+echo "order_test: all passed"
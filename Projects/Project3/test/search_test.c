@@ -0,0 +1,244 @@
+/******************************************************************************
+ * search_test - check every search kernel against a reference
+ *
+ * Forces each of the scalar, SSE2 and AVX2 kernels in turn through
+ * search_use() (skipping those the CPU lacks) and compares:
+ *
+ *   search_find        with memmem
+ *   search_find_icase  with a byte at a time ASCII-folding search
+ *   search_count       with a byte at a time count
+ *
+ * on random haystacks over small alphabets (so that partial matches are
+ * common), with needles of every length from 1 up, matches placed to
+ * straddle the 16 and 32 byte blocks the vector kernels step by, and
+ * tails shorter than a vector.  Every haystack gets a buffer of its own
+ * of exactly its length, so a kernel that reads past the end shows up
+ * under -fsanitize=address.
+ *
+ * Compile and run with:
+ *   $ make test
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../search.h"
+
+#define MAX_HAY 700
+#define MAX_NEEDLE 70
+#define RANDOM_ROUNDS 40000
+
+static const char* kernels[] = { "scalar", "sse2", "avx2" };
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+static unsigned long checks;
+static int failed;
+
+/* xorshift64*, so that every run sees the same inputs */
+static uint32_t rng (void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static void fill (char* buf, size_t len, const char* alphabet)
+{
+    size_t n = strlen(alphabet), i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = alphabet[rng() % n];
+}
+
+static inline unsigned char fold (unsigned char c)
+{
+    return c - 'A' < 26u ? c | 0x20 : c;
+}
+
+static const char* ref_find_icase (const char* hay, size_t n, const char* needle,
+                                   size_t m)
+{
+    size_t i, j;
+
+    for (i = 0; i + m <= n; i++) {
+        for (j = 0; j < m && fold(hay[i + j]) == (unsigned char)needle[j]; j++)
+            ;
+        if (j == m)
+            return hay + i;
+    }
+
+    return NULL;
+}
+
+static size_t ref_count (const char* buf, size_t len, char c)
+{
+    size_t n = 0, i;
+
+    for (i = 0; i < len; i++)
+        n += buf[i] == c;
+
+    return n;
+}
+
+static void report (const char* kernel, const char* what, const char* hay, size_t n,
+                    const char* needle, size_t m, long got, long want)
+{
+    if (failed++ >= 10)
+        return;
+    fprintf(stderr, "FAIL %s %s: hay %zu bytes \"%.*s\", needle \"%.*s\": "
+            "got %ld, want %ld\n",
+            kernel, what, n, (int)(n < 80 ? n : 80), hay, (int)m, needle, got, want);
+}
+
+/* search hay[0..n) (copied to a buffer of exactly n bytes) for needle
+ * with both search_find and, folded, search_find_icase */
+static void check_find (const char* kernel, const char* hay, size_t n, const char* needle,
+                        size_t m)
+{
+    char* h = malloc(n ? n : 1);
+    char* folded = malloc(m);
+    const char* got;
+    const char* want;
+    size_t i;
+
+    if (!h || !folded) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(h, hay, n);
+    for (i = 0; i < m; i++)
+        folded[i] = fold(needle[i]);
+
+    got = search_find(h, n, needle, m);
+    want = memmem(h, n, needle, m);
+    if (got != want)
+        report(kernel, "find", h, n, needle, m, got ? got - h : -1, want ? want - h : -1);
+
+    got = search_find_icase(h, n, folded, m);
+    want = ref_find_icase(h, n, folded, m);
+    if (got != want)
+        report(kernel, "find_icase", h, n, folded, m, got ? got - h : -1,
+               want ? want - h : -1);
+
+    checks += 2;
+    free(h);
+    free(folded);
+}
+
+static void check_count (const char* kernel, const char* buf, size_t len, char c)
+{
+    char* b = malloc(len ? len : 1);
+    size_t got, want;
+
+    if (!b) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(b, buf, len);
+
+    got = search_count(b, len, c);
+    want = ref_count(b, len, c);
+    if (got != want)
+        report(kernel, "count", b, len, &c, 1, got, want);
+
+    checks++;
+    free(b);
+}
+
+static void test_kernel (const char* kernel)
+{
+    /* "aAzZ@[`{" has the bytes just outside A-Z and a-z, which must
+     * not fold; count tests use the one with newlines */
+    static const char* alphabets[] = { "ab", "abc", "aAbB", "xX_-1\n", "aAzZ@[`{",
+                                       "abcdefghijklmnop" };
+    static char big[300000];
+    char hay[MAX_HAY];
+    char needle[MAX_NEEDLE];
+    size_t n, m, pos, edge, r;
+    const char* alphabet;
+
+    /* random haystacks and needles, short needles more often */
+    for (r = 0; r < RANDOM_ROUNDS; r++) {
+        alphabet = alphabets[rng() % (sizeof(alphabets) / sizeof(alphabets[0]))];
+        n = rng() % MAX_HAY;
+        m = r % 4 < 2 ? r % 4 + 1 : 1 + rng() % (MAX_NEEDLE - 1);
+        fill(hay, n, alphabet);
+        if (rng() % 2 && m <= n) {
+            /* take the needle from the haystack so that it is there */
+            pos = rng() % (n - m + 1);
+            memcpy(needle, hay + pos, m);
+        }
+        else
+            fill(needle, m, alphabet);
+        check_find(kernel, hay, n, needle, m);
+    }
+
+    /* a single match placed across every block edge, in a haystack that
+     * has no other (and no partial) match */
+    for (m = 1; m < MAX_NEEDLE; m += m < 8 ? 1 : 7) {
+        memset(needle, 'q', m);
+        needle[0] = 'n';
+        needle[m - 1] = 'e';
+        for (edge = 16; edge <= 128; edge += 16) {
+            for (pos = edge > m ? edge - m : 0; pos <= edge && pos + m <= MAX_HAY;
+                    pos++) {
+                n = pos + m + rng() % 40;
+                if (n > MAX_HAY)
+                    n = MAX_HAY;
+                memset(hay, '.', n);
+                memcpy(hay + pos, needle, m);
+                check_find(kernel, hay, n, needle, m);
+            }
+        }
+    }
+
+    /* matches in tails shorter than a vector, for every haystack length
+     * up to a few vectors */
+    for (n = 0; n < 100; n++) {
+        for (m = 1; m <= 3 && m <= n; m++) {
+            memset(hay, '.', n);
+            memcpy(hay + n - m, "nee", m);
+            check_find(kernel, hay, n, "nee", m);
+            check_find(kernel, hay, n, "xyz", m);
+        }
+    }
+
+    /* newline counts, including runs long enough for the per-lane
+     * counters to be folded several times */
+    for (r = 0; r < 2000; r++) {
+        n = rng() % MAX_HAY;
+        fill(hay, n, alphabets[3]);
+        check_count(kernel, hay, n, '\n');
+    }
+    memset(big, '\n', sizeof(big));
+    check_count(kernel, big, sizeof(big), '\n');
+    check_count(kernel, big + 1, sizeof(big) - 7, '\n');
+    fill(big, sizeof(big), alphabets[3]);
+    check_count(kernel, big, sizeof(big), '\n');
+}
+
+int main (void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (search_use(kernels[i]) < 0) {
+            printf("search_test: %s: not supported here, skipped\n", kernels[i]);
+            continue;
+        }
+        checks = 0;
+        test_kernel(kernels[i]);
+        printf("search_test: %s: %lu checks\n", kernels[i], checks);
+    }
+
+    if (failed) {
+        printf("search_test: %d failure(s)\n", failed);
+        return EXIT_FAILURE;
+    }
+    printf("search_test: all passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/******************************************************************************
+ * uring.c - bare bones io_uring support for minigrep
+ *
+ * liburing isn't assumed to be installed, so the rings are set up and
+ * driven directly with io_uring_setup(2), io_uring_enter(2) and
+ * io_uring_register(2).  Only what minigrep needs is here: grab an SQE,
+ * submit, and walk the completion queue.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#define __NR_io_uring_register 427
+#endif
+
+
+/* returns -1 (with errno set) if the kernel won't give us a ring */
+int uring_init (struct uring* ring, unsigned int entries)
+{
+    struct io_uring_params p;
+    void* ptr;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->entries = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto fail_sq;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED)
+        goto fail_cq;
+    ring->sqes = ptr;
+
+    ring->sq_head = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+
+fail_cq:
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+fail_sq:
+    munmap(ring->sq_ptr, ring->sq_size);
+fail:
+    close(ring->fd);
+    return -1;
+}
+
+void uring_destroy (struct uring* ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+/* ask the kernel whether it implements "opcode" */
+int uring_supports (struct uring* ring, unsigned int opcode)
+{
+    struct io_uring_probe* probe;
+    size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int ok = 0;
+
+    probe = calloc(1, size);
+    if (!probe)
+        return 0;
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0
+            && opcode <= probe->last_op)
+        ok = !!(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+
+    return ok;
+}
+
+
+/* returns a zeroed submission entry, or NULL if the queue is full */
+struct io_uring_sqe* uring_get_sqe (struct uring* ring)
+{
+    unsigned int head, tail, index;
+    struct io_uring_sqe* sqe;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    tail = *ring->sq_tail;
+    if (tail - head >= ring->entries)
+        return NULL;
+
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+/* submit everything queued so far and wait for at least "wait_nr"
+ * completions */
+int uring_submit_and_wait (struct uring* ring, unsigned int wait_nr)
+{
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret >= 0)
+        ring->to_submit -= ret < (int)ring->to_submit ? ret : ring->to_submit;
+
+    return ret;
+}
+
+/* returns the oldest unseen completion, or NULL if there is none */
+struct io_uring_cqe* uring_peek_cqe (struct uring* ring)
+{
+    unsigned int head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen (struct uring* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,41 @@
+#ifndef _uring_h_
+#define _uring_h_
+
+#include <linux/io_uring.h>
+
+/* a minimal io_uring instance driven through the raw system calls.  each
+ * ring is owned by a single thread, so the submission and completion
+ * queues need no locking of their own */
+struct uring {
+    int fd;
+    unsigned int entries;
+
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int to_submit;
+
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+int uring_init (struct uring* ring, unsigned int entries);
+void uring_destroy (struct uring* ring);
+int uring_supports (struct uring* ring, unsigned int opcode);
+
+struct io_uring_sqe* uring_get_sqe (struct uring* ring);
+int uring_submit_and_wait (struct uring* ring, unsigned int wait_nr);
+struct io_uring_cqe* uring_peek_cqe (struct uring* ring);
+void uring_cqe_seen (struct uring* ring);
+
+#endif /* _uring_h_ */